@@ -0,0 +1,343 @@
+/**
+ * @file gentree.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Generates a synthetic directory tree for benchmarking tixfsgen. The tree is
+ * completely determined by the options (including the seed), so that results
+ * from different builds can be compared.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+/* Largest file that fits in a TIXFS page along with its inode */
+#define GENTREE_FILE_SIZE_MAX (0x4000 - 7)
+
+#define GENTREE_PATH_MAX 4096
+
+typedef enum {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXP,
+} size_dist;
+
+typedef struct {
+    char path[GENTREE_PATH_MAX];
+    int depth;
+} gen_dir;
+
+/**
+ * State of the xorshift64* generator.
+ */
+static uint64_t rng_state;
+
+static uint64_t rng_next(void);
+static double rng_unit(void);
+static int rng_range(int max);
+
+static int parse_int(const char *str, int *value);
+static int parse_size_dist(const char *str,
+        size_dist *dist, int *arg1, int *arg2);
+static int next_size(size_dist dist, int arg1, int arg2);
+
+static int write_file(const char *path, int size);
+
+static void usage(const char *exec_name);
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int file_count = 500;
+    int dir_count = 32;
+    int max_depth = 4;
+    int link_count = 0;
+    int dev_count = 0;
+    int seed = 1;
+    size_dist dist = SIZE_EXP;
+    int dist_arg1 = 512, dist_arg2 = 0;
+
+    gen_dir *dirs;
+    char (*files)[GENTREE_PATH_MAX];
+    char path[GENTREE_PATH_MAX];
+    long total_bytes = 0;
+    int made_links = 0, made_devs = 0;
+
+    while ((opt = getopt(argc, argv, ":n:s:D:d:l:c:S:h")) != -1) {
+        int ok = 1;
+
+        switch (opt) {
+        case 'n':
+            ok = parse_int(optarg, &file_count) == 0;
+            break;
+        case 's':
+            ok = parse_size_dist(optarg, &dist, &dist_arg1, &dist_arg2) == 0;
+            break;
+        case 'D':
+            ok = parse_int(optarg, &dir_count) == 0;
+            break;
+        case 'd':
+            ok = parse_int(optarg, &max_depth) == 0;
+            break;
+        case 'l':
+            ok = parse_int(optarg, &link_count) == 0;
+            break;
+        case 'c':
+            ok = parse_int(optarg, &dev_count) == 0;
+            break;
+        case 'S':
+            ok = parse_int(optarg, &seed) == 0;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        case ':':
+            fprintf(stderr, "Error: Argument required for option: %c\n",
+                    optopt);
+            return EXIT_FAILURE;
+        default:
+            fprintf(stderr, "Error: Unknown option: -%c\n", optopt);
+            return EXIT_FAILURE;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "Error: Invalid argument for -%c: %s\n",
+                    opt, optarg);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Error: No output directory specified.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* 0 is a fixed point of xorshift */
+    rng_state = (uint64_t) seed * 0x9E3779B97F4A7C15ull + 1;
+
+    if (mkdir(argv[optind], 0755) < 0 && errno != EEXIST) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    dirs = malloc((dir_count + 1) * sizeof(dirs[0]));
+    files = malloc((file_count + 1) * sizeof(files[0]));
+    if (!dirs || !files) {
+        perror("Memory error");
+        return EXIT_FAILURE;
+    }
+
+    snprintf(dirs[0].path, GENTREE_PATH_MAX, "%s", argv[optind]);
+    dirs[0].depth = 0;
+
+    /* Each directory goes in a random earlier one that is not too deep. The
+     * root is always allowed, so this always finds one.
+     */
+    for (int i = 1; i <= dir_count; i++) {
+        int parent;
+        do {
+            parent = rng_range(i);
+        } while (dirs[parent].depth >= max_depth && parent != 0);
+
+        snprintf(dirs[i].path, GENTREE_PATH_MAX, "%s/d%04d",
+                dirs[parent].path, i);
+        dirs[i].depth = dirs[parent].depth + 1;
+
+        if (mkdir(dirs[i].path, 0755) < 0 && errno != EEXIST) {
+            perror(dirs[i].path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < file_count; i++) {
+        int size = next_size(dist, dist_arg1, dist_arg2);
+
+        snprintf(files[i], GENTREE_PATH_MAX, "%s/f%05d",
+                dirs[rng_range(dir_count + 1)].path, i);
+        if (write_file(files[i], size) < 0) {
+            perror(files[i]);
+            return EXIT_FAILURE;
+        }
+
+        total_bytes += size;
+    }
+
+    for (int i = 0; i < link_count && file_count > 0; i++) {
+        snprintf(path, GENTREE_PATH_MAX, "%s/l%05d",
+                dirs[rng_range(dir_count + 1)].path, i);
+        unlink(path);
+        if (link(files[rng_range(file_count)], path) < 0) {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+
+        made_links++;
+    }
+
+    for (int i = 0; i < dev_count; i++) {
+        dev_t dev = makedev(1 + rng_range(16), rng_range(256));
+        mode_t type = rng_range(2) ? S_IFCHR : S_IFBLK;
+
+        snprintf(path, GENTREE_PATH_MAX, "%s/c%05d",
+                dirs[rng_range(dir_count + 1)].path, i);
+        unlink(path);
+        if (mknod(path, type | 0644, dev) < 0) {
+            if (errno == EPERM) {
+                fprintf(stderr,
+                        "Warning: Not allowed to create device nodes. "
+                        "Skipping them.\n");
+                break;
+            }
+
+            perror(path);
+            return EXIT_FAILURE;
+        }
+
+        made_devs++;
+    }
+
+    printf("files %d\ndirs %d\nlinks %d\ndevices %d\nbytes %ld\n",
+            file_count, dir_count + 1, made_links, made_devs, total_bytes);
+
+    free(dirs);
+    free(files);
+    return EXIT_SUCCESS;
+}
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static double rng_unit(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int rng_range(int max) {
+    return max > 0 ? (int) (rng_next() % max) : 0;
+}
+
+static int parse_int(const char *str, int *value) {
+    char *end_ptr;
+    long tmp = strtol(str, &end_ptr, 0);
+
+    if (end_ptr == str || *end_ptr != 0 || tmp < 0 || tmp > 0x7FFFFFFF) {
+        return -1;
+    }
+
+    *value = tmp;
+    return 0;
+}
+
+/**
+ * Parses a size distribution: "fixed:<size>", "uniform:<min>:<max>", or
+ * "exp:<mean>".
+ */
+static int parse_size_dist(const char *str,
+        size_dist *dist, int *arg1, int *arg2) {
+    char buf[64];
+    char *sep;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    sep = strchr(buf, ':');
+    if (!sep) {
+        return -1;
+    }
+    *sep++ = 0;
+
+    if (strcmp(buf, "fixed") == 0) {
+        *dist = SIZE_FIXED;
+        return parse_int(sep, arg1);
+    } else if (strcmp(buf, "exp") == 0) {
+        *dist = SIZE_EXP;
+        return parse_int(sep, arg1);
+    } else if (strcmp(buf, "uniform") == 0) {
+        char *max = strchr(sep, ':');
+        if (!max) {
+            return -1;
+        }
+        *max++ = 0;
+
+        *dist = SIZE_UNIFORM;
+        if (parse_int(sep, arg1) < 0 || parse_int(max, arg2) < 0
+                || *arg2 < *arg1) {
+            return -1;
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+static int next_size(size_dist dist, int arg1, int arg2) {
+    int size;
+
+    switch (dist) {
+    case SIZE_FIXED:
+        size = arg1;
+        break;
+    case SIZE_UNIFORM:
+        size = arg1 + rng_range(arg2 - arg1 + 1);
+        break;
+    case SIZE_EXP:
+    default:
+        /* Inverse transform sampling */
+        size = (int) (-arg1 * log1p(-rng_unit()));
+        break;
+    }
+
+    return size > GENTREE_FILE_SIZE_MAX ? GENTREE_FILE_SIZE_MAX : size;
+}
+
+/**
+ * Writes a file of pseudo-random bytes.
+ */
+static int write_file(const char *path, int size) {
+    uint8_t buf[256];
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        return -1;
+    }
+
+    while (size > 0) {
+        int len = size < (int) sizeof(buf) ? size : (int) sizeof(buf);
+
+        for (int i = 0; i < len; i++) {
+            buf[i] = rng_next() >> 56;
+        }
+
+        fwrite(buf, 1, len, file);
+        size -= len;
+    }
+
+    return fclose(file);
+}
+
+static void usage(const char *exec_name) {
+    printf(
+"usage: %s [OPTION]... <DIRECTORY>\n"
+"Generate a synthetic directory tree for benchmarking tixfsgen.\n\n"
+"options:\n"
+"  -n<count>        number of regular files (default 500)\n"
+"  -s<dist>         distribution of file sizes: fixed:<size>,\n"
+"                     uniform:<min>:<max>, or exp:<mean> (default exp:512)\n"
+"  -D<count>        number of directories besides the root (default 32)\n"
+"  -d<depth>        maximum depth of directories (default 4)\n"
+"  -l<count>        number of extra hard links to files (default 0)\n"
+"  -c<count>        number of device nodes (default 0). Creating these\n"
+"                     usually requires root\n"
+"  -S<seed>         seed for the random number generator (default 1)\n"
+            ,exec_name);
+}
+
+/* vim: set tw=80 ft=c: */
@@ -0,0 +1,144 @@
+#!/bin/sh
+#
+# run.sh
+#
+# Times tixfsgen on a set of synthetic trees made by gentree. Each scenario is
+# run several times, and the results are written as CSV (one row per run) and
+# JSON (one summary per scenario) so that they can be compared across builds.
+# The time of each phase comes from tixfsgen's --stats-json output.
+#
+
+set -e
+
+TIXFSGEN=bin/tixfsgen
+GENTREE=bin/gentree
+OUT=build/bench
+RUNS=5
+ONLY=
+
+usage() {
+    cat <<USAGE
+usage: $0 [-t tixfsgen] [-g gentree] [-o outdir] [-r runs] [-s scenario]
+Time tixfsgen on synthetic trees and write the results to
+<outdir>/results.csv and <outdir>/results.json.
+USAGE
+}
+
+while getopts "t:g:o:r:s:h" opt; do
+    case $opt in
+    t) TIXFSGEN=$OPTARG ;;
+    g) GENTREE=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    r) RUNS=$OPTARG ;;
+    s) ONLY=$OPTARG ;;
+    h) usage; exit 0 ;;
+    *) usage >&2; exit 1 ;;
+    esac
+done
+
+# Name and gentree options of each scenario. All of them have to fit in the
+# default page range.
+SCENARIOS="
+small   -n200 -sexp:256 -D16 -d4
+wide    -n2000 -sexp:96 -D4 -d1
+deep    -n500 -sexp:512 -D200 -d16
+large   -n80 -suniform:8192:16000 -D8 -d2
+links   -n500 -sexp:256 -D32 -d4 -l200 -c50
+"
+
+now() {
+    date +%s%N
+}
+
+mkdir -p "$OUT/trees"
+CSV=$OUT/results.csv
+JSON=$OUT/results.json
+
+PHASES="scan read layout encode write"
+
+echo "scenario,run,seconds,$(echo $PHASES | tr ' ' ',')" > "$CSV"
+echo "[" > "$JSON"
+first=1
+
+echo "$SCENARIOS" | while read -r name args; do
+    [ -n "$name" ] || continue
+    [ -z "$ONLY" ] || [ "$ONLY" = "$name" ] || continue
+
+    tree=$OUT/trees/$name
+    rm -rf "$tree"
+    # shellcheck disable=SC2086
+    info=$("$GENTREE" $args "$tree")
+    files=$(echo "$info" | awk '$1 == "files" { print $2 }')
+    bytes=$(echo "$info" | awk '$1 == "bytes" { print $2 }')
+
+    # Warm up the page cache so that the first run is not an outlier
+    "$TIXFSGEN" "$OUT/$name.hex" "$tree"
+    sum=$(cksum < "$OUT/$name.hex")
+
+    times=
+    run=1
+    while [ "$run" -le "$RUNS" ]; do
+        start=$(now)
+        "$TIXFSGEN" --stats-json="$OUT/$name.stats.json" "$OUT/$name.hex" \
+            "$tree"
+        end=$(now)
+
+        secs=$(awk -v s="$start" -v e="$end" \
+            'BEGIN { printf "%.6f", (e - s) / 1e9 }')
+
+        # Each phase is on its own line, as "<name>": <seconds>
+        phases=
+        for phase in $PHASES; do
+            t=$(awk -v p="\"$phase\":" \
+                '$1 == p { sub(/,$/, "", $2); printf "%.6f", $2 }' \
+                "$OUT/$name.stats.json")
+            phases="$phases,$t"
+        done
+
+        echo "$name,$run,$secs$phases" >> "$CSV"
+        times="$times $secs"
+
+        # The output must not depend on anything but the tree
+        if [ "$(cksum < "$OUT/$name.hex")" != "$sum" ]; then
+            echo "Error: Output of $name differs between runs" >&2
+            exit 1
+        fi
+
+        run=$((run + 1))
+    done
+
+    summary=$(echo "$times" | tr ' ' '\n' | grep . | sort -n | awk '
+        { t[NR] = $1; total += $1 }
+        END {
+            median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+            printf "\"min\": %.6f, \"median\": %.6f, \"mean\": %.6f, " \
+                "\"max\": %.6f", t[1], median, total / NR, t[NR]
+        }')
+
+    # Mean time of each phase over the runs of this scenario
+    phase_summary=$(awk -F, -v n="$name" -v phases="$PHASES" '
+        BEGIN { count = split(phases, names, " ") }
+        $1 == n {
+            runs++
+            for (i = 1; i <= count; i++) {
+                total[i] += $(3 + i)
+            }
+        }
+        END {
+            for (i = 1; i <= count; i++) {
+                printf "%s\"%s\": %.6f", (i > 1 ? ", " : ""), names[i],
+                    total[i] / runs
+            }
+        }' "$CSV")
+
+    [ "$first" = 1 ] || echo "," >> "$JSON"
+    first=0
+    printf '  {"scenario": "%s", "files": %s, "bytes": %s, "runs": %s, %s, ' \
+        "$name" "$files" "$bytes" "$RUNS" "$summary" >> "$JSON"
+    printf '"phases": {%s}}' "$phase_summary" >> "$JSON"
+
+    echo "$name: $summary" | tr -d '"'
+done
+
+echo "" >> "$JSON"
+echo "]" >> "$JSON"
@@ -0,0 +1,271 @@
+/**
+ * @file analyze.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <string.h>
+
+#include "analyze.h"
+
+/**
+ * Pages used by the current lookup.
+ */
+typedef struct {
+    analyze_model *model;
+    analyze_cost *cost;
+    uint8_t seen[32];
+} analyze_state;
+
+/**
+ * Maps in a page, if it is not already, and counts the bytes read from it.
+ * @return The page, or NULL if it is not in the image.
+ */
+static const uint8_t *analyze_touch(analyze_state *state, uint8_t page,
+        long bytes);
+
+/**
+ * Reads an inode, checking that it and its contents are inside its page.
+ * @return 0 on success, TIXFS_ERR_CORRUPT if it is not valid.
+ */
+static int analyze_read_inode(analyze_state *state, tix_far_ptr loc,
+        tixfs_inode *inode, const uint8_t **data);
+
+/**
+ * Scans the inode file for the location of an inode.
+ * @return 0 on success, TIXFS_ERR_CORRUPT if it is not there.
+ */
+static int analyze_find_inode(analyze_state *state, tix_far_ptr if_loc,
+        const tixfs_inode *if_inode, uint16_t num, tix_far_ptr *loc);
+
+/**
+ * Looks up the path of a file being walked.
+ */
+static int analyze_visit(void *ctx, const tixfs_entry *entry);
+
+static uint16_t analyze_get_word(const uint8_t *src);
+
+void analyze_model_init(analyze_model *model, tixfs_page_reader read_page,
+        void *page_ctx, uint8_t start_page) {
+    model->read_page = read_page;
+    model->page_ctx = page_ctx;
+    model->start_page = start_page;
+    model->mapped = -1;
+}
+
+int analyze_lookup(analyze_model *model, const char *path,
+        analyze_cost *cost) {
+    analyze_state state = {model, cost, {0}};
+    long page_switches = cost->page_switches;
+    long bytes_scanned = cost->bytes_scanned;
+    const uint8_t *anchor;
+    const uint8_t *data;
+    tixfs_inode if_inode;
+    tixfs_inode inode;
+    tix_far_ptr if_loc;
+    tix_far_ptr loc;
+    uint16_t num = 1;
+    int ret = TIXFS_OK;
+
+    /* The inode file location is at the end of the anchor block */
+    anchor = analyze_touch(&state, model->start_page + 3, 3);
+    if (!anchor) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    if_loc.page = anchor[TIXFS_PAGE_SIZE - 4];
+    if_loc.addr = analyze_get_word(&anchor[TIXFS_PAGE_SIZE - 3]);
+    if (analyze_read_inode(&state, if_loc, &if_inode, &data) < 0
+            || if_inode.mode != TIX_S_INDFIL) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    for (;;) {
+        const char *name;
+        int name_len;
+        int i;
+
+        if (analyze_find_inode(&state, if_loc, &if_inode, num, &loc) < 0
+                || analyze_read_inode(&state, loc, &inode, &data) < 0) {
+            return TIXFS_ERR_CORRUPT;
+        }
+
+        while (*path == '/') {
+            path++;
+        }
+
+        if (!*path) {
+            /* Found it, so read the contents */
+            analyze_touch(&state, loc.page, inode.size);
+            break;
+        }
+
+        name = path;
+        name_len = strcspn(path, "/");
+        path += name_len;
+
+        if ((inode.mode & TIX_S_IFMT) != TIX_S_IFDIR) {
+            ret = TIXFS_ERR_NOENT;
+            break;
+        }
+
+        /* Entries are scanned in order, starting with ".." */
+        for (i = 0; i + TIXFS_SIZEOF_DIR_ENTRY <= inode.size;
+                i += TIXFS_SIZEOF_DIR_ENTRY) {
+            const char *entry_name = (const char *) &data[i + 2];
+
+            if (name_len <= TIXFS_NAME_MAX
+                    && strncmp(entry_name, name, name_len) == 0
+                    && (name_len == TIXFS_NAME_MAX
+                        || entry_name[name_len] == 0)) {
+                break;
+            }
+        }
+
+        if (i + TIXFS_SIZEOF_DIR_ENTRY > inode.size) {
+            analyze_touch(&state, loc.page, inode.size);
+            ret = TIXFS_ERR_NOENT;
+            break;
+        }
+
+        analyze_touch(&state, loc.page, i + TIXFS_SIZEOF_DIR_ENTRY);
+        num = analyze_get_word(&data[i]);
+    }
+
+    cost->lookups++;
+    if (ret == TIXFS_ERR_NOENT) {
+        cost->not_found++;
+    }
+
+    cost->cycles += (cost->page_switches - page_switches)
+        * ANALYZE_CYCLES_PAGE_SWITCH
+        + (cost->bytes_scanned - bytes_scanned) * ANALYZE_CYCLES_PER_BYTE;
+    return ret;
+}
+
+int analyze_lookups(tixfs_page_reader read_page, void *page_ctx,
+        uint8_t start_page, analyze_cost *cost) {
+    analyze_model model;
+    analyze_state state;
+
+    memset(cost, 0, sizeof(*cost));
+    analyze_model_init(&model, read_page, page_ctx, start_page);
+
+    state.model = &model;
+    state.cost = cost;
+    return tixfs_walk(read_page, page_ctx, start_page, analyze_visit, &state);
+}
+
+double analyze_pages_per_lookup(const analyze_cost *cost) {
+    if (cost->lookups == 0) {
+        return 0;
+    }
+
+    return (double) cost->pages_touched / cost->lookups;
+}
+
+void analyze_print(const analyze_cost *cost, FILE *stream) {
+    double lookups = cost->lookups ? cost->lookups : 1;
+
+    fprintf(stream,
+            "Lookups: %ld (%ld not found)\n"
+            "Page switches: %ld (%.2f per lookup)\n"
+            "Pages touched: %ld (%.2f per lookup)\n"
+            "Bytes scanned: %ld (%.1f per lookup)\n"
+            "Estimated cycles: %ld (%.0f per lookup)\n",
+            cost->lookups, cost->not_found,
+            cost->page_switches, cost->page_switches / lookups,
+            cost->pages_touched, cost->pages_touched / lookups,
+            cost->bytes_scanned, cost->bytes_scanned / lookups,
+            cost->cycles, cost->cycles / lookups);
+}
+
+static const uint8_t *analyze_touch(analyze_state *state, uint8_t page,
+        long bytes) {
+    analyze_cost *cost = state->cost;
+
+    if (page != state->model->mapped) {
+        state->model->mapped = page;
+        cost->page_switches++;
+    }
+
+    if (!(state->seen[page / 8] & (1 << (page % 8)))) {
+        state->seen[page / 8] |= 1 << (page % 8);
+        cost->pages_touched++;
+    }
+
+    cost->bytes_scanned += bytes;
+    return state->model->read_page(state->model->page_ctx, page);
+}
+
+static int analyze_read_inode(analyze_state *state, tix_far_ptr loc,
+        tixfs_inode *inode, const uint8_t **data) {
+    int offset = loc.addr - TIXFS_REL_ADDR;
+    const uint8_t *page;
+
+    if (loc.addr < TIXFS_REL_ADDR
+            || offset + TIXFS_SIZEOF_INODE > TIXFS_PAGE_SIZE) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    page = analyze_touch(state, loc.page, TIXFS_SIZEOF_INODE);
+    if (!page) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    page += offset;
+    inode->mode = analyze_get_word(&page[0]);
+    inode->size = analyze_get_word(&page[2]);
+    inode->uid = page[4];
+    inode->gid = page[5];
+    inode->nlinks = page[6];
+
+    if (offset + TIXFS_SIZEOF_INODE + inode->size > TIXFS_PAGE_SIZE) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    *data = &page[TIXFS_SIZEOF_INODE];
+    return TIXFS_OK;
+}
+
+static int analyze_find_inode(analyze_state *state, tix_far_ptr if_loc,
+        const tixfs_inode *if_inode, uint16_t num, tix_far_ptr *loc) {
+    int count = if_inode->size / TIXFS_SIZEOF_INODE_ENTRY;
+    const uint8_t *entries = state->model->read_page(
+            state->model->page_ctx, if_loc.page);
+
+    /* This was already checked when reading the inode file's inode */
+    entries += if_loc.addr - TIXFS_REL_ADDR + TIXFS_SIZEOF_INODE;
+
+    for (int i = 0; i < count; i++) {
+        const uint8_t *entry = &entries[i * TIXFS_SIZEOF_INODE_ENTRY];
+
+        if (analyze_get_word(entry) == num) {
+            analyze_touch(state, if_loc.page,
+                    (i + 1) * TIXFS_SIZEOF_INODE_ENTRY);
+            loc->page = entry[2];
+            loc->addr = analyze_get_word(&entry[3]);
+            return TIXFS_OK;
+        }
+    }
+
+    analyze_touch(state, if_loc.page, count * TIXFS_SIZEOF_INODE_ENTRY);
+    return TIXFS_ERR_CORRUPT;
+}
+
+static int analyze_visit(void *ctx, const tixfs_entry *entry) {
+    analyze_state *state = ctx;
+
+    /* Skip the inode file and the root */
+    if (!entry->path || entry->parent == 0) {
+        return 0;
+    }
+
+    return analyze_lookup(state->model, entry->path, state->cost);
+}
+
+static uint16_t analyze_get_word(const uint8_t *src) {
+    return src[0] | (src[1] << 8);
+}
+
+/* vim: set tw=80 ft=c: */
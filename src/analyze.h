@@ -0,0 +1,113 @@
+/**
+ * @file analyze.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Estimates of how much work TIX has to do to look paths up in an image.
+ *
+ * A lookup is modeled as TIX does it: the location of the inode file is read
+ * from the anchor block, then for each directory on the path its inode is
+ * found by scanning the inode file, and its entries are scanned for the next
+ * name. Finally the file's inode and contents are read. Each time a different
+ * page than the one currently mapped is needed, it has to be mapped in.
+ */
+
+#ifndef ANALYZE_H_
+#define ANALYZE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tixfs.h"
+
+/**
+ * Estimated cycles to map in a different page, including the call to do it.
+ */
+#define ANALYZE_CYCLES_PAGE_SWITCH 100
+
+/**
+ * Estimated cycles to compare or copy each byte scanned.
+ */
+#define ANALYZE_CYCLES_PER_BYTE 20
+
+/**
+ * Cost of one lookup, or the sum over several.
+ */
+typedef struct {
+    /**
+     * Number of paths looked up, and how many of those were not found.
+     */
+    long lookups;
+    long not_found;
+
+    /**
+     * Number of times a different page had to be mapped in.
+     */
+    long page_switches;
+
+    /**
+     * Number of different pages used by each lookup: the anchor block, the
+     * inode file, every directory on the path, and the file itself.
+     */
+    long pages_touched;
+
+    /**
+     * Bytes read from the anchor block, inode file, inodes, directory
+     * entries, and the file's contents.
+     */
+    long bytes_scanned;
+
+    long cycles;
+} analyze_cost;
+
+/**
+ * Image being looked up in, and the page which is currently mapped.
+ */
+typedef struct {
+    tixfs_page_reader read_page;
+    void *page_ctx;
+    uint8_t start_page;
+
+    /**
+     * Page mapped at the end of the last lookup, or -1 for none. This stays
+     * mapped for the next one.
+     */
+    int mapped;
+} analyze_model;
+
+void analyze_model_init(analyze_model *model, tixfs_page_reader read_page,
+        void *page_ctx, uint8_t start_page);
+
+/**
+ * Looks up a path and adds its cost.
+ * @param model Image to look up in.
+ * @param path TIX path from the root.
+ * @param cost Cost to add to.
+ * @return 0 on success, TIXFS_ERR_NOENT if the path does not exist (the cost
+ * of finding that out is still added), or TIXFS_ERR_CORRUPT if the image is
+ * invalid.
+ */
+int analyze_lookup(analyze_model *model, const char *path, analyze_cost *cost);
+
+/**
+ * Looks up the path of every file in an image except the root, in the order
+ * they are in the directory tree.
+ * @param cost Set to the total cost.
+ * @return 0 on success, or a negative TIXFS_ERR_* code.
+ */
+int analyze_lookups(tixfs_page_reader read_page, void *page_ctx,
+        uint8_t start_page, analyze_cost *cost);
+
+/**
+ * Gets the average number of pages touched per lookup.
+ */
+double analyze_pages_per_lookup(const analyze_cost *cost);
+
+/**
+ * Prints the totals of a cost and their averages per lookup.
+ */
+void analyze_print(const analyze_cost *cost, FILE *stream);
+
+#endif /* ANALYZE_H_ */
+
+/* vim: set tw=80 ft=c: */
@@ -0,0 +1,225 @@
+/**
+ * @file filter.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+#define FILTER_INIT_CAP 8
+
+/**
+ * Checks whether a string contains any glob special characters.
+ */
+static int filter_has_glob(const char *str, int len);
+
+static int filter_rule_match(const filter_rule *rule, const char *str);
+
+int filter_init(filter_list *filter) {
+    if (!filter) {
+        return -1;
+    }
+
+    filter->rules = malloc(sizeof(filter->rules[0]) * FILTER_INIT_CAP);
+    if (!filter->rules) {
+        return -1;
+    }
+
+    filter->len = 0;
+    filter->cap = FILTER_INIT_CAP;
+    filter->dir_only_count = 0;
+    return 0;
+}
+
+void filter_destroy(filter_list *filter) {
+    if (!filter) {
+        return;
+    }
+
+    for (int i = 0; i < filter->len; i++) {
+        free(filter->rules[i].pattern);
+    }
+
+    free(filter->rules);
+}
+
+int filter_add(filter_list *filter, const char *pattern, filter_action action) {
+    filter_rule rule;
+    int len;
+
+    if (!filter || !pattern) {
+        return -1;
+    }
+
+    rule.action = action;
+    rule.anchored = 0;
+    rule.dir_only = 0;
+
+    len = strlen(pattern);
+    if (len > 1 && pattern[len - 1] == '/') {
+        rule.dir_only = 1;
+        len--;
+    }
+
+    if (memchr(pattern, '/', len)) {
+        rule.anchored = 1;
+    }
+
+    if (pattern[0] == '/') {
+        pattern++;
+        len--;
+    }
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    /* Classify the pattern so that most of them can be matched without
+     * fnmatch(). A '*' cannot match a '/', so patterns matching the whole path
+     * always go through fnmatch() if they have any wildcards.
+     */
+    if (!filter_has_glob(pattern, len)) {
+        rule.kind = FILTER_LITERAL;
+    } else if (rule.anchored) {
+        rule.kind = FILTER_GLOB;
+    } else if (pattern[0] == '*' && !filter_has_glob(pattern + 1, len - 1)) {
+        rule.kind = FILTER_SUFFIX;
+        pattern++;
+        len--;
+    } else if (pattern[len - 1] == '*'
+            && !filter_has_glob(pattern, len - 1)) {
+        rule.kind = FILTER_PREFIX;
+        len--;
+    } else {
+        rule.kind = FILTER_GLOB;
+    }
+
+    rule.pattern = strndup(pattern, len);
+    if (!rule.pattern) {
+        return -1;
+    }
+    rule.len = len;
+
+    if (filter->len == filter->cap) {
+        filter->cap *= 2;
+        filter->rules = realloc(filter->rules,
+                sizeof(filter->rules[0]) * filter->cap);
+        if (!filter->rules) {
+            filter->cap /= 2;
+            free(rule.pattern);
+            return -1;
+        }
+    }
+
+    filter->rules[filter->len++] = rule;
+    if (rule.dir_only) {
+        filter->dir_only_count++;
+    }
+
+    return 0;
+}
+
+int filter_add_file(filter_list *filter, const char *filename) {
+    FILE *file;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int ret = 0;
+
+    file = fopen(filename, "r");
+    if (!file) {
+        return -1;
+    }
+
+    while ((len = getline(&line, &line_cap, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = 0;
+        }
+
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        if (line[0] == '!') {
+            ret = filter_add(filter, &line[1], FILTER_INCLUDE);
+        } else {
+            ret = filter_add(filter, line, FILTER_EXCLUDE);
+        }
+
+        if (ret < 0) {
+            fprintf(stderr, "Warning: Invalid pattern in %s: %s\n",
+                    filename, line);
+            ret = 0;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return ret;
+}
+
+int filter_excluded(const filter_list *filter,
+        const char *path, const char *name, int is_dir) {
+    if (!filter) {
+        return 0;
+    }
+
+    /* The last matching rule decides */
+    for (int i = filter->len - 1; i >= 0; i--) {
+        const filter_rule *rule = &filter->rules[i];
+
+        if (rule->dir_only && !is_dir) {
+            continue;
+        }
+
+        if (filter_rule_match(rule, rule->anchored ? path : name)) {
+            return rule->action == FILTER_EXCLUDE;
+        }
+    }
+
+    return 0;
+}
+
+static int filter_has_glob(const char *str, int len) {
+    for (int i = 0; i < len; i++) {
+        switch (str[i]) {
+        case '*':
+        case '?':
+        case '[':
+        case '\\':
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int filter_rule_match(const filter_rule *rule, const char *str) {
+    int len;
+
+    switch (rule->kind) {
+    case FILTER_LITERAL:
+        return strcmp(str, rule->pattern) == 0;
+
+    case FILTER_PREFIX:
+        return strncmp(str, rule->pattern, rule->len) == 0;
+
+    case FILTER_SUFFIX:
+        len = strlen(str);
+        return len >= rule->len
+            && memcmp(&str[len - rule->len], rule->pattern, rule->len) == 0;
+
+    case FILTER_GLOB:
+        return fnmatch(rule->pattern, str,
+                rule->anchored ? FNM_PATHNAME : 0) == 0;
+    }
+
+    return 0;
+}
+
+/* vim: set tw=80 ft=c: */
@@ -0,0 +1,104 @@
+/**
+ * @file filter.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+typedef enum filter_action {
+    FILTER_EXCLUDE,
+    FILTER_INCLUDE,
+} filter_action;
+
+/**
+ * How a pattern is matched. Patterns without wildcards (or with a single one
+ * at either end) are compared directly instead of going through fnmatch().
+ */
+typedef enum filter_kind {
+    FILTER_LITERAL,
+    FILTER_PREFIX,
+    FILTER_SUFFIX,
+    FILTER_GLOB,
+} filter_kind;
+
+/**
+ * Compiled glob pattern.
+ */
+typedef struct filter_rule {
+    filter_action action;
+    filter_kind kind;
+
+    /**
+     * Whether the pattern is matched against the whole path instead of only
+     * the name of the file. This is the case if the pattern contains a '/'
+     * anywhere except at the end.
+     */
+    int anchored;
+
+    /**
+     * Whether the pattern only matches directories (it ended with a '/').
+     */
+    int dir_only;
+
+    /**
+     * Pattern with the leading and trailing '/' and, for prefix and suffix
+     * patterns, the '*' removed.
+     */
+    char *pattern;
+    int len;
+} filter_rule;
+
+/**
+ * Ordered list of include and exclude patterns. When several patterns match a
+ * path, the last one wins.
+ */
+typedef struct {
+    int len;
+    int cap;
+    filter_rule *rules;
+
+    /**
+     * Number of rules which only match directories. If there are none, the
+     * type of a file does not have to be known to match it.
+     */
+    int dir_only_count;
+} filter_list;
+
+int filter_init(filter_list *filter);
+void filter_destroy(filter_list *filter);
+
+/**
+ * Compiles and adds a pattern to the end of a filter list.
+ * @param filter Filter list.
+ * @param pattern Glob pattern, as for fnmatch().
+ * @param action Whether paths matching the pattern are included or excluded.
+ * @return 0 on success, -1 on error.
+ */
+int filter_add(filter_list *filter, const char *pattern, filter_action action);
+
+/**
+ * Adds patterns read from a file, one per line. Empty lines and lines starting
+ * with '#' are ignored, and lines starting with '!' are include patterns.
+ * @param filter Filter list.
+ * @param filename File to read.
+ * @return 0 on success, -1 if the file could not be read.
+ */
+int filter_add_file(filter_list *filter, const char *filename);
+
+/**
+ * Checks whether a file should be left out.
+ * @param filter Filter list.
+ * @param path Path of the file relative to the root directory.
+ * @param name Name of the file (the last component of path).
+ * @param is_dir Whether the file is a directory. This is only used if
+ * filter->dir_only_count is non-zero.
+ * @return Non-zero if the file is excluded.
+ */
+int filter_excluded(const filter_list *filter,
+        const char *path, const char *name, int is_dir);
+
+#endif /* FILTER_H_ */
+
+/* vim: set tw=80 ft=c: */
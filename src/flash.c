@@ -0,0 +1,173 @@
+/**
+ * @file flash.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash.h"
+#include "ihex.h"
+#include "tixfs.h"
+
+/**
+ * Gets a page for writing, allocating it if it is erased.
+ * @return The page, or NULL if out of memory.
+ */
+static uint8_t *flash_page_alloc(flash_image *flash, int page);
+
+/**
+ * Copies a data record from an Intel hex file into the image.
+ */
+static int flash_load_record(void *ctx, uint8_t page, uint16_t addr,
+        const uint8_t *data, int len);
+
+static int flash_load_bin(flash_image *flash, FILE *file);
+
+int flash_init(flash_image *flash) {
+    if (!flash) {
+        return -1;
+    }
+
+    memset(flash->pages, 0, sizeof(flash->pages));
+    return 0;
+}
+
+void flash_destroy(flash_image *flash) {
+    if (!flash) {
+        return;
+    }
+
+    for (int i = 0; i < FLASH_PAGE_COUNT; i++) {
+        free(flash->pages[i]);
+    }
+}
+
+int flash_load(flash_image *flash, const char *filename) {
+    FILE *file;
+    int c;
+    int line;
+    int ret;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    c = getc(file);
+    ungetc(c, file);
+
+    if (c == ':') {
+        ret = ihex_read(file, flash_load_record, flash, &line);
+        if (ret < 0 && !ferror(file)) {
+            fprintf(stderr, "Error: Invalid Intel hex on line %d of %s\n",
+                    line, filename);
+        }
+    } else {
+        ret = flash_load_bin(flash, file);
+    }
+
+    fclose(file);
+    return ret;
+}
+
+const uint8_t *flash_page(const flash_image *flash, int page) {
+    if (page < 0 || page >= FLASH_PAGE_COUNT) {
+        return NULL;
+    }
+
+    return flash->pages[page];
+}
+
+const uint8_t *flash_read_page(void *flash, uint8_t page) {
+    return flash_page(flash, page);
+}
+
+int flash_page_equal(const flash_image *flash, int page, const uint8_t *data) {
+    const uint8_t *old = flash_page(flash, page);
+
+    if (old) {
+        return memcmp(old, data, TIXFS_PAGE_SIZE) == 0;
+    }
+
+    for (int i = 0; i < TIXFS_PAGE_SIZE; i++) {
+        if (data[i] != 0xFF) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint8_t *flash_page_alloc(flash_image *flash, int page) {
+    if (!flash->pages[page]) {
+        flash->pages[page] = malloc(TIXFS_PAGE_SIZE);
+        if (!flash->pages[page]) {
+            return NULL;
+        }
+
+        memset(flash->pages[page], 0xFF, TIXFS_PAGE_SIZE);
+    }
+
+    return flash->pages[page];
+}
+
+static int flash_load_record(void *ctx, uint8_t page, uint16_t addr,
+        const uint8_t *data, int len) {
+    flash_image *flash = ctx;
+
+    /* Each page is mapped at TIXFS_REL_ADDR, but only the offset into the
+     * page matters
+     */
+    for (int i = 0; i < len; i++) {
+        uint16_t byte_addr = addr + i;
+        uint8_t *dest = flash_page_alloc(flash, page);
+
+        if (!dest) {
+            return -1;
+        }
+
+        dest[byte_addr % TIXFS_PAGE_SIZE] = data[i];
+        if (byte_addr % TIXFS_PAGE_SIZE == TIXFS_PAGE_SIZE - 1) {
+            page++;
+        }
+    }
+
+    return 0;
+}
+
+static int flash_load_bin(flash_image *flash, FILE *file) {
+    uint8_t *buf = malloc(TIXFS_PAGE_SIZE);
+    size_t len;
+
+    if (!buf) {
+        return -1;
+    }
+
+    for (int page = 0; page < FLASH_PAGE_COUNT; page++) {
+        len = fread(buf, 1, TIXFS_PAGE_SIZE, file);
+        if (len == 0) {
+            break;
+        }
+
+        /* Pages that are completely erased do not need to be stored */
+        memset(&buf[len], 0xFF, TIXFS_PAGE_SIZE - len);
+        if (flash_page_equal(flash, page, buf)) {
+            continue;
+        }
+
+        uint8_t *dest = flash_page_alloc(flash, page);
+        if (!dest) {
+            free(buf);
+            return -1;
+        }
+        memcpy(dest, buf, TIXFS_PAGE_SIZE);
+    }
+
+    free(buf);
+    return ferror(file) ? -1 : 0;
+}
+
+/* vim: set tw=80 ft=c: */
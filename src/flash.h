@@ -0,0 +1,56 @@
+/**
+ * @file flash.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Contents of the flash pages of an existing image, for comparing against or
+ * reusing parts of it.
+ */
+
+#ifndef FLASH_H_
+#define FLASH_H_
+
+#include <stdint.h>
+
+#define FLASH_PAGE_COUNT 256
+
+/**
+ * Pages of flash. Pages which are not in the image are left erased (all 0xFF)
+ * and are not allocated.
+ */
+typedef struct {
+    uint8_t *pages[FLASH_PAGE_COUNT];
+} flash_image;
+
+int flash_init(flash_image *flash);
+void flash_destroy(flash_image *flash);
+
+/**
+ * Reads an image from a file. Files starting with ':' are read as Intel hex,
+ * and anything else as a binary dump of the flash starting at page 0.
+ * @param flash Image to read into. Pages already in it are overwritten.
+ * @param filename File to read.
+ * @return 0 on success, -1 if the file could not be read or is invalid.
+ */
+int flash_load(flash_image *flash, const char *filename);
+
+/**
+ * Gets the contents of a page.
+ * @return The page (TIXFS_PAGE_SIZE bytes), or NULL if it is erased.
+ */
+const uint8_t *flash_page(const flash_image *flash, int page);
+
+/**
+ * Gets a page of an image as a tixfs_page_reader, with the image as the
+ * context.
+ */
+const uint8_t *flash_read_page(void *flash, uint8_t page);
+
+/**
+ * Checks whether a page of the image has the given contents.
+ */
+int flash_page_equal(const flash_image *flash, int page, const uint8_t *data);
+
+#endif /* FLASH_H_ */
+
+/* vim: set tw=80 ft=c: */
@@ -2,21 +2,31 @@
  * @file id_map.c
  * @author Zach Peltzer
  * @date Created: Thu, 08 Feb 2018
- * @date Last Modified: Thu, 08 Feb 2018
+ * @date Last Modified: Sun, 18 Oct 2026
  */
 
 #include <stdlib.h>
 
 #include "id_map.h"
 
-#define ID_MAP_INIT_CAP 4
+#define ID_MAP_INIT_CAP 16
+
+/**
+ * Gets the first slot to probe for a key.
+ */
+static int id_map_slot(const id_map *map, uint64_t key);
+
+/**
+ * Doubles the number of slots and re-inserts all of the entries.
+ */
+static int id_map_grow(id_map *map);
 
 int id_map_init(id_map *map) {
     if (!map) {
         return -1;
     }
 
-    map->ids = malloc(sizeof(map->ids[0]) * ID_MAP_INIT_CAP);
+    map->ids = calloc(ID_MAP_INIT_CAP, sizeof(map->ids[0]));
     if (!map->ids) {
         return -1;
     }
@@ -34,36 +44,41 @@ void id_map_destroy(id_map *map) {
     free(map->ids);
 }
 
-int id_map_add(id_map *map, int key, int val) {
+int id_map_add(id_map *map, uint64_t key, int val) {
+    int i;
+
     if (!map) {
         return -1;
     }
 
-    for (int i = 0; i < map->len; i++) {
+    /* Keep the load factor at most 1/2 so that probe sequences stay short */
+    if ((map->len + 1) * 2 > map->cap && id_map_grow(map) < 0) {
+        return -1;
+    }
+
+    for (i = id_map_slot(map, key); map->ids[i].used;
+            i = (i + 1) & (map->cap - 1)) {
         if (map->ids[i].key == key) {
             map->ids[i].val = val;
             return 0;
         }
     }
 
-    if (map->len == map->cap) {
-        map->cap *= 2;
-        map->ids = realloc(map->ids, sizeof(map->ids[0]) * map->cap);
-        if (!map->ids) {
-            map->cap /= 2;
-            return -1;
-        }
-    }
-
-    map->ids[map->len].key = key;
-    map->ids[map->len].val = val;
+    map->ids[i].key = key;
+    map->ids[i].val = val;
+    map->ids[i].used = 1;
     map->len++;
 
     return 0;
 }
 
-int id_map_search(id_map *map, int key) {
-    for (int i = 0; i < map->len; i++) {
+int id_map_search(const id_map *map, uint64_t key) {
+    if (!map || map->len == 0) {
+        return -1;
+    }
+
+    for (int i = id_map_slot(map, key); map->ids[i].used;
+            i = (i + 1) & (map->cap - 1)) {
         if (map->ids[i].key == key) {
             return map->ids[i].val;
         }
@@ -72,4 +87,37 @@ int id_map_search(id_map *map, int key) {
     return -1;
 }
 
+static int id_map_slot(const id_map *map, uint64_t key) {
+    /* Fibonacci hashing, so that sequential IDs are spread out */
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    return (hash ^ (hash >> 32)) & (map->cap - 1);
+}
+
+static int id_map_grow(id_map *map) {
+    id_map new_map;
+
+    new_map.len = 0;
+    new_map.cap = map->cap * 2;
+    new_map.ids = calloc(new_map.cap, sizeof(new_map.ids[0]));
+    if (!new_map.ids) {
+        return -1;
+    }
+
+    for (int i = 0; i < map->cap; i++) {
+        if (map->ids[i].used) {
+            int j = id_map_slot(&new_map, map->ids[i].key);
+            while (new_map.ids[j].used) {
+                j = (j + 1) & (new_map.cap - 1);
+            }
+
+            new_map.ids[j] = map->ids[i];
+            new_map.len++;
+        }
+    }
+
+    free(map->ids);
+    *map = new_map;
+    return 0;
+}
+
 /* vim: set tw=80 ft=c: */
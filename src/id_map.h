@@ -2,27 +2,51 @@
  * @file id_map.h
  * @author Zach Peltzer
  * @date Created: Thu, 08 Feb 2018
- * @date Last Modified: Thu, 08 Feb 2018
+ * @date Last Modified: Sun, 18 Oct 2026
  */
 
 #ifndef ID_MAP_H_
 #define ID_MAP_H_
 
+#include <stdint.h>
+
+/**
+ * Hash map from host IDs to TIX IDs, using open addressing with linear probing.
+ * Keys are 64 bits wide so that a device's major and minor numbers can be
+ * combined into a single key.
+ */
 typedef struct {
+    /**
+     * Number of entries in the map.
+     */
     int len;
+
+    /**
+     * Number of slots. This is always a power of 2 and at least twice len.
+     */
     int cap;
 
     struct {
-        int key;
+        uint64_t key;
         int val;
+        int used;
     } *ids;
 } id_map;
 
 int id_map_init(id_map *map);
 void id_map_destroy(id_map *map);
 
-int id_map_add(id_map *map, int key, int val);
-int id_map_search(id_map *map, int key);
+/**
+ * Adds a mapping, replacing any existing one for the same key.
+ * @return 0 on success, -1 on error.
+ */
+int id_map_add(id_map *map, uint64_t key, int val);
+
+/**
+ * Looks up a key.
+ * @return The value mapped to key, or -1 if there is none.
+ */
+int id_map_search(const id_map *map, uint64_t key);
 
 #endif /* ID_MAP_H_ */
 
@@ -2,12 +2,14 @@
  * @file ihex.c
  * @author Zach Peltzer
  * @date Created: Fri, 02 Feb 2018
- * @date Last Modified: Thu, 22 Feb 2018
+ * @date Last Modified: Sun, 18 Oct 2026
  */
 
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ihex.h"
 
@@ -26,13 +28,32 @@ static void ihex_start_block(ihex_data *ih, ihex_block_type type);
  */
 static void ihex_finish_block(ihex_data *ih);
 
-int ihex_data_init(ihex_data *ih, FILE *stream,
-        uint8_t block_len, uint8_t page, uint16_t addr) {
-    if (!ih || !stream) {
+/**
+ * Writes a whole block other than a data block.
+ */
+static void ihex_write_block(ihex_data *ih, ihex_block_type type,
+        const uint8_t *data, int len);
+
+/**
+ * Writes a byte as two hexadecimal digits.
+ * @return Pointer to after the digits.
+ */
+static char *ihex_put_byte(char *dest, uint8_t byte);
+
+/**
+ * Parses two hexadecimal digits.
+ * @return The byte, or -1 if the characters are not hexadecimal digits.
+ */
+static int ihex_parse_byte(const char *str);
+
+int ihex_data_init(ihex_data *ih, FILE *stream, uint8_t block_len,
+        ihex_addressing addressing, uint8_t page, uint16_t addr) {
+    if (!ih || !stream || block_len == 0) {
         return -1;
     }
 
-    ih->block_data = malloc(block_len);
+    /* Other blocks can be longer than block_len */
+    ih->block_data = malloc(IHEX_BLOCK_LEN_MAX);
     if (!ih->block_data) {
         return -1;
     }
@@ -43,6 +64,11 @@ int ihex_data_init(ihex_data *ih, FILE *stream,
     ih->len = 0;
     ih->addr = 0x0000;
     ih->type = IH_NONE;
+    ih->addressing = addressing;
+    ih->ext_addr = -1;
+
+    ih->records = 0;
+    ih->bytes = 0;
 
     ihex_set_page(ih, page, addr);
 
@@ -93,8 +119,30 @@ void ihex_write_data(ihex_data *ih, const void *data, int size) {
     /* Just a cast to make the syntax easier below */
     const uint8_t *byte_data = (uint8_t *) data;
 
-    for (int i = 0; i < size; i++) {
-        ihex_write_byte(ih, byte_data[i]);
+    if (!ih) {
+        return;
+    }
+
+    /* Copy as much as fits in each block at once */
+    while (size > 0) {
+        int len = ih->block_len - ih->len;
+
+        if (ih->type == IH_NONE) {
+            ihex_start_block(ih, IH_DATA);
+        }
+
+        if (len > size) {
+            len = size;
+        }
+
+        memcpy(&ih->block_data[ih->len], byte_data, len);
+        ih->len += len;
+        byte_data += len;
+        size -= len;
+
+        if (ih->len == ih->block_len) {
+            ihex_finish_block(ih);
+        }
     }
 }
 
@@ -110,12 +158,29 @@ void ihex_set_addr(ihex_data *ih, uint16_t addr) {
 }
 
 void ihex_set_page(ihex_data *ih, uint8_t page, uint16_t addr) {
-    ihex_set_addr(ih, 0x0000);
-    ihex_start_block(ih, IH_PAGE);
-    ihex_write_byte(ih, 0x00);
-    ihex_write_byte(ih, page);
-    ihex_finish_block(ih);
+    if (ih->addressing == IH_ADDR_LINEAR) {
+        uint32_t linear = (uint32_t) page * IHEX_PAGE_SIZE
+            + addr % IHEX_PAGE_SIZE;
+
+        /* Pages never cross a 64K boundary, so the data of a page is all
+         * within the same extended address
+         */
+        if ((long) (linear >> 16) != ih->ext_addr) {
+            uint8_t upper[2] = {linear >> 24, linear >> 16};
+
+            ih->ext_addr = linear >> 16;
+            ihex_set_addr(ih, 0x0000);
+            ihex_write_block(ih, IH_EXT_LINEAR, upper, 2);
+        }
+
+        ihex_set_addr(ih, (uint16_t) linear);
+        return;
+    }
+
+    uint8_t segment[2] = {0x00, page};
 
+    ihex_set_addr(ih, 0x0000);
+    ihex_write_block(ih, IH_PAGE, segment, 2);
     ihex_set_addr(ih, addr);
 }
 
@@ -127,6 +192,9 @@ static void ihex_start_block(ihex_data *ih, ihex_block_type type) {
 }
 
 static void ihex_finish_block(ihex_data *ih) {
+    /* ':', length, address, type, data, checksum, and line break */
+    char line[1 + 2 + 4 + 2 + 2 * IHEX_BLOCK_LEN_MAX + 2 + 2];
+    char *end = line;
     uint8_t chksum;
 
     if (ih->type == IH_NONE) {
@@ -137,20 +205,176 @@ static void ihex_finish_block(ihex_data *ih) {
         + (uint8_t) ih->addr + (uint8_t) (ih->addr >> 8)
         + ih->type;
 
-    fprintf(ih->stream, ":%02X%04X%02X", ih->len, ih->addr, ih->type);
+    /* The whole line is formatted at once, since this is most of the time
+     * taken to write the output
+     */
+    *end++ = ':';
+    end = ihex_put_byte(end, ih->len);
+    end = ihex_put_byte(end, ih->addr >> 8);
+    end = ihex_put_byte(end, ih->addr);
+    end = ihex_put_byte(end, ih->type);
     for (int i = 0; i < ih->len; i++) {
-        fprintf(ih->stream, "%02X", ih->block_data[i]);
+        end = ihex_put_byte(end, ih->block_data[i]);
         chksum += ih->block_data[i];
     }
 
-    /* Have to re-cast the checksum after negation because of type promotion
-     * when using variable-argument functions.
-     */
-    fprintf(ih->stream, "%02X\r\n", (uint8_t) -chksum);
+    end = ihex_put_byte(end, -chksum);
+    *end++ = '\r';
+    *end++ = '\n';
+
+    fwrite(line, 1, end - line, ih->stream);
+
+    ih->records++;
+    ih->bytes += end - line;
 
     ih->addr += ih->len;
     ih->len = 0;
     ih->type = IH_NONE;
 }
 
+static void ihex_write_block(ihex_data *ih, ihex_block_type type,
+        const uint8_t *data, int len) {
+    ihex_start_block(ih, type);
+    memcpy(ih->block_data, data, len);
+    ih->len = len;
+    ihex_finish_block(ih);
+}
+
+static char *ihex_put_byte(char *dest, uint8_t byte) {
+    static const char digits[] = "0123456789ABCDEF";
+
+    *dest++ = digits[byte >> 4];
+    *dest++ = digits[byte & 0xF];
+    return dest;
+}
+
+int ihex_read(FILE *stream, ihex_read_cb cb, void *ctx, int *line) {
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    ssize_t len;
+    /* Length, address, type, data, checksum */
+    uint8_t record[5 + IHEX_BLOCK_LEN_MAX];
+    uint8_t page = 0;
+    uint32_t ext_addr = 0;
+    int linear = 0;
+    int line_num = 0;
+    int ret = -1;
+
+    while ((len = getline(&buf, &buf_cap, stream)) != -1) {
+        uint8_t chksum = 0;
+        int count;
+
+        line_num++;
+        while (len > 0 && isspace((unsigned char) buf[len - 1])) {
+            buf[--len] = 0;
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        /* ':', then the length, address, type, data, and checksum as pairs of
+         * hexadecimal digits
+         */
+        count = (len - 1) / 2;
+        if (buf[0] != ':' || len % 2 != 1 || count < 5
+                || count > 5 + IHEX_BLOCK_LEN_MAX) {
+            goto done;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int byte = ihex_parse_byte(&buf[1 + 2 * i]);
+            if (byte < 0) {
+                goto done;
+            }
+
+            record[i] = byte;
+            chksum += byte;
+        }
+
+        if (chksum != 0 || record[0] != count - 5) {
+            goto done;
+        }
+
+        switch (record[3]) {
+        case IH_DATA: {
+            uint16_t addr = (record[1] << 8) | record[2];
+
+            if (linear) {
+                uint32_t linear_page = (ext_addr + addr) / IHEX_PAGE_SIZE;
+
+                /* Only 256 pages can be given with page blocks, either */
+                if (linear_page > 0xFF) {
+                    goto done;
+                }
+                page = linear_page;
+            }
+
+            if (cb && cb(ctx, page, addr, &record[4], record[0]) < 0) {
+                goto done;
+            }
+            break;
+        }
+
+        case IH_END:
+            ret = 0;
+            goto done;
+
+        case IH_PAGE:
+            /* The page is the low byte of the 16-bit value */
+            if (record[0] != 2) {
+                goto done;
+            }
+            page = record[5];
+            linear = 0;
+            break;
+
+        case IH_EXT_LINEAR:
+            if (record[0] != 2) {
+                goto done;
+            }
+            ext_addr = (uint32_t) ((record[4] << 8) | record[5]) << 16;
+            linear = 1;
+            break;
+
+        default:
+            goto done;
+        }
+    }
+
+    /* Files without an end block are accepted */
+    if (!ferror(stream)) {
+        ret = 0;
+    }
+
+done:
+    if (ret < 0 && line) {
+        *line = line_num;
+    }
+
+    free(buf);
+    return ret;
+}
+
+static int ihex_parse_byte(const char *str) {
+    int byte = 0;
+
+    for (int i = 0; i < 2; i++) {
+        char c = str[i];
+
+        byte <<= 4;
+        if (c >= '0' && c <= '9') {
+            byte |= c - '0';
+        } else if (c >= 'A' && c <= 'F') {
+            byte |= c - 'A' + 10;
+        } else if (c >= 'a' && c <= 'f') {
+            byte |= c - 'a' + 10;
+        } else {
+            return -1;
+        }
+    }
+
+    return byte;
+}
+
 /* vim: set tw=80 ft=c: */
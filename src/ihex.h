@@ -2,7 +2,7 @@
  * @file ihex.h
  * @author Zach Peltzer
  * @date Created: Fri, 02 Feb 2018
- * @date Last Modified: Fri, 02 Feb 2018
+ * @date Last Modified: Sun, 18 Oct 2026
  */
 
 #ifndef IHEX_H_
@@ -11,13 +11,42 @@
 #include <stdint.h>
 #include <stdio.h>
 
+/**
+ * Size of a flash page, for converting between pages and linear addresses.
+ */
+#define IHEX_PAGE_SIZE 0x4000
+
+/**
+ * Maximum number of data bytes in a block.
+ */
+#define IHEX_BLOCK_LEN_MAX 255
+
 typedef enum ihex_block_type {
     IH_NONE = -1,
     IH_DATA = 0,
     IH_END  = 1,
     IH_PAGE = 2,
+    IH_EXT_LINEAR = 4,
 } ihex_block_type;
 
+/**
+ * How pages are given in the output.
+ */
+typedef enum ihex_addressing {
+    /**
+     * A page block (type 2) with the page number before the data of each page,
+     * which keeps the address it is mapped at.
+     */
+    IH_ADDR_PAGE,
+
+    /**
+     * Flat addresses, with page n starting at n * IHEX_PAGE_SIZE, and an
+     * extended linear address block (type 4) whenever the upper 16 bits
+     * change.
+     */
+    IH_ADDR_LINEAR,
+} ihex_addressing;
+
 /**
  * Stores the state of writing in Intel hex format.
  */
@@ -47,24 +76,44 @@ typedef struct ihex_data {
      */
     ihex_block_type type;
 
+    ihex_addressing addressing;
+
+    /**
+     * Upper 16 bits of the address from the last extended linear address
+     * block, or -1 if there has not been one.
+     */
+    long ext_addr;
+
     /**
      * Since we cannot know how much data will be in each block, it is buffered
      * and the block written all at once.
      * This will be allocated to be block_len bytes in size.
      */
     uint8_t *block_data;
+
+    /**
+     * Number of blocks (records) written so far.
+     */
+    long records;
+
+    /**
+     * Number of characters written so far.
+     */
+    long bytes;
 } ihex_data;
 
 /**
  * Initializes an Intel hex format writer.
  * @param ih Intel hex writer state.
  * @param stream Stream to write to.
- * @param block_len Maximum number of bytes in each block.
+ * @param block_len Maximum number of bytes in each block (at least 1).
+ * @param addressing How pages are given.
  * @param addr Starting address to output. This can be changed later via
  * ihex_set_addr().
+ * @return 0 on success, -1 if the arguments are invalid or out of memory.
  */
-int ihex_data_init(ihex_data *ih, FILE *stream,
-        uint8_t block_len, uint8_t page, uint16_t addr);
+int ihex_data_init(ihex_data *ih, FILE *stream, uint8_t block_len,
+        ihex_addressing addressing, uint8_t page, uint16_t addr);
 
 /**
  * Finalizes the Intel hex data and frees data from an Intel hex writer.
@@ -124,7 +173,10 @@ void ihex_set_addr(ihex_data *ih, uint16_t addr);
 
 /**
  * Changes the output page and address to write to.
- * This finishes the current block and writes a page block.
+ * This finishes the current block and writes a page block, or with linear
+ * addressing, an extended linear address block if the upper 16 bits of the
+ * address change. Only the offset of addr into the page is used for linear
+ * addresses.
  * @param ih Intel hex writer state.
  * @param page New page to set.
  * @param addr Starting address for this page. This are set at the same time as
@@ -133,6 +185,32 @@ void ihex_set_addr(ihex_data *ih, uint16_t addr);
  */
 void ihex_set_page(ihex_data *ih, uint8_t page, uint16_t addr);
 
+/**
+ * Receives the data records of an Intel hex file as it is read.
+ * @param ctx Pointer passed to ihex_read().
+ * @param page Page set by the last page block (0 before the first one), or
+ * the page containing the start of the data for linear addresses.
+ * @param addr Address of the data. For linear addresses, this is the lower 16
+ * bits, so its offset into the page is still correct.
+ * @param data Data of the record.
+ * @param len Number of bytes of data.
+ * @return 0 to continue, or -1 to stop reading.
+ */
+typedef int (*ihex_read_cb)(void *ctx, uint8_t page, uint16_t addr,
+        const uint8_t *data, int len);
+
+/**
+ * Reads a file in Intel hex format, as written by ihex_data_init() and the
+ * other functions, with either kind of addressing.
+ * @param stream Stream to read from. Reading stops at the end block.
+ * @param cb Function to pass each data block to.
+ * @param ctx Pointer to pass to cb.
+ * @param line Set to the line number of the error, if there is one. Can be
+ * NULL.
+ * @return 0 on success, -1 if the file is invalid or cb stopped reading.
+ */
+int ihex_read(FILE *stream, ihex_read_cb cb, void *ctx, int *line);
+
 #endif /* IHEX_H_ */
 
 /* vim: set tw=80 ft=c: */
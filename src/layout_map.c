@@ -0,0 +1,144 @@
+/**
+ * @file layout_map.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash.h"
+#include "layout_map.h"
+#include "manifest.h"
+
+/**
+ * Writes the line for one file.
+ */
+static int layout_map_visit(void *ctx, const tixfs_entry *entry);
+
+static int layout_map_read(tixfs_prev *prev, FILE *file,
+        const char *filename);
+
+int layout_map_write(const tixfs_image *img, FILE *stream) {
+    fprintf(stream, "%s\n", LAYOUT_MAP_HEADER);
+    return layout_map_write_files(img, stream);
+}
+
+int layout_map_write_files(const tixfs_image *img, FILE *stream) {
+    tixfs_info info;
+
+    tixfs_image_info(img, &info);
+
+    if (tixfs_walk(tixfs_image_page, (void *) img, info.start_page,
+                layout_map_visit, stream) < 0) {
+        return -1;
+    }
+
+    return ferror(stream) ? -1 : 0;
+}
+
+int layout_map_load(tixfs_prev *prev, const char *filename,
+        uint8_t start_page) {
+    char header[sizeof(LAYOUT_MAP_HEADER) + sizeof(MANIFEST_HEADER)];
+    flash_image flash;
+    FILE *file;
+    int ret;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    if (!fgets(header, sizeof(header), file)) {
+        header[0] = 0;
+    }
+    header[strcspn(header, "\r\n")] = 0;
+
+    /* A manifest has the same lines for the files */
+    if (strcmp(header, LAYOUT_MAP_HEADER) == 0
+            || strcmp(header, MANIFEST_HEADER) == 0) {
+        ret = layout_map_read(prev, file, filename);
+        fclose(file);
+        return ret;
+    }
+    fclose(file);
+
+    /* Anything else is an image */
+    flash_init(&flash);
+    if (flash_load(&flash, filename) < 0) {
+        flash_destroy(&flash);
+        return -1;
+    }
+
+    ret = tixfs_prev_load(prev, flash_read_page, &flash, start_page);
+    if (ret < 0) {
+        fprintf(stderr, "Error: %s: %s.\n", filename, tixfs_strerror(ret));
+    }
+
+    flash_destroy(&flash);
+    return ret < 0 ? -1 : 0;
+}
+
+static int layout_map_visit(void *ctx, const tixfs_entry *entry) {
+    FILE *stream = ctx;
+
+    fprintf(stream, "%u 0x%02X:0x%04X %u", entry->inode_num,
+            entry->loc.page, entry->loc.addr, entry->inode.size);
+    if (entry->path) {
+        fprintf(stream, " %s", entry->path);
+    }
+    fputc('\n', stream);
+
+    return 0;
+}
+
+static int layout_map_read(tixfs_prev *prev, FILE *file,
+        const char *filename) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int line_num = 1;
+    int ret = 0;
+
+    while ((len = getline(&line, &line_cap, file)) != -1) {
+        unsigned int inode_num, page, addr, size;
+        int path_start = 0;
+
+        line_num++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = 0;
+        }
+
+        /* Checksums from a manifest are not needed */
+        if (len == 0 || line[0] == '#' || strncmp(line, "page ", 5) == 0
+                || strncmp(line, "block ", 6) == 0) {
+            continue;
+        }
+
+        if (sscanf(line, "%u %x:%x %u%n", &inode_num, &page, &addr, &size,
+                    &path_start) < 4
+                || inode_num > 0xFFFF || page > 0xFF || addr > 0xFFFF
+                || size > 0xFFFF) {
+            fprintf(stderr, "Error: Invalid layout on line %d of %s\n",
+                    line_num, filename);
+            ret = -1;
+            break;
+        }
+
+        /* The path is the rest of the line, after one space */
+        const char *path = line[path_start] == ' '
+            ? &line[path_start + 1] : NULL;
+
+        if (tixfs_prev_add(prev, path, inode_num,
+                    (tix_far_ptr) {page, addr}, size) < 0) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(line);
+    return ret;
+}
+
+/* vim: set tw=80 ft=c: */
@@ -0,0 +1,55 @@
+/**
+ * @file layout_map.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Text file listing where each file of an image is, so that a later image can
+ * keep them in the same places without needing the image itself.
+ *
+ * After a header line, each line has the inode number, location, size, and
+ * path of a file:
+ *
+ *     # tixfsgen layout map
+ *     0 0x1F:0x4A00 35
+ *     1 0x08:0x4000 64 /
+ *     2 0x08:0x4047 12 /etc/motd
+ *
+ * The inode file (inode 0) has no path. Other lines starting with '#' are
+ * ignored.
+ */
+
+#ifndef LAYOUT_MAP_H_
+#define LAYOUT_MAP_H_
+
+#include <stdio.h>
+
+#include "tixfs.h"
+
+#define LAYOUT_MAP_HEADER "# tixfsgen layout map"
+
+/**
+ * Writes the layout map of an encoded image.
+ * @return 0 on success, -1 on error.
+ */
+int layout_map_write(const tixfs_image *img, FILE *stream);
+
+/**
+ * Writes the lines for the files of an encoded image, without the header.
+ * @return 0 on success, -1 on error.
+ */
+int layout_map_write_files(const tixfs_image *img, FILE *stream);
+
+/**
+ * Reads a previous layout from a layout map, a manifest, an Intel hex image,
+ * or a binary dump of the flash.
+ * @param prev Layout to add the files to.
+ * @param filename File to read.
+ * @param start_page First page of the filesystem in the image.
+ * @return 0 on success, -1 if the file could not be read or is invalid.
+ */
+int layout_map_load(tixfs_prev *prev, const char *filename,
+        uint8_t start_page);
+
+#endif /* LAYOUT_MAP_H_ */
+
+/* vim: set tw=80 ft=c: */
@@ -0,0 +1,104 @@
+/**
+ * @file manifest.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "layout_map.h"
+#include "manifest.h"
+
+/**
+ * Table for computing the CRC a byte at a time, filled in on first use.
+ */
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void manifest_init_crc_table(void);
+
+/**
+ * Checks whether a page is entirely erased.
+ */
+static int manifest_page_erased(const uint8_t *page);
+
+int manifest_write(const tixfs_image *img, FILE *stream) {
+    const uint8_t *data = tixfs_image_data(img, NULL);
+    tixfs_info info;
+
+    if (!data) {
+        return -1;
+    }
+
+    tixfs_image_info(img, &info);
+    fprintf(stream, "%s\n", MANIFEST_HEADER);
+
+    for (int page = info.start_page; page <= info.last_page; page++) {
+        const uint8_t *page_data =
+            &data[(long) (page - info.start_page) * TIXFS_PAGE_SIZE];
+
+        if (manifest_page_erased(page_data)) {
+            fprintf(stream, "page 0x%02X erased\n", page);
+        } else {
+            fprintf(stream, "page 0x%02X 0x%08X\n", page,
+                    manifest_crc32(0, page_data, TIXFS_PAGE_SIZE));
+        }
+    }
+
+    /* Only whole blocks, since they are erased as a whole */
+    for (int block = (info.start_page + 3) & ~3;
+            block + 3 <= info.last_page; block += 4) {
+        const uint8_t *block_data =
+            &data[(long) (block - info.start_page) * TIXFS_PAGE_SIZE];
+        int erased = 1;
+
+        for (int i = 0; i < 4 && erased; i++) {
+            erased = manifest_page_erased(&block_data[i * TIXFS_PAGE_SIZE]);
+        }
+
+        if (erased) {
+            fprintf(stream, "block 0x%02X erased\n", block);
+        } else {
+            fprintf(stream, "block 0x%02X 0x%08X\n", block,
+                    manifest_crc32(0, block_data, 4 * TIXFS_PAGE_SIZE));
+        }
+    }
+
+    if (layout_map_write_files(img, stream) < 0) {
+        return -1;
+    }
+
+    return ferror(stream) ? -1 : 0;
+}
+
+uint32_t manifest_crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    /* Images can be written from several threads */
+    pthread_once(&crc_table_once, manifest_init_crc_table);
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static void manifest_init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+
+        for (int bit = 0; bit < 8; bit++) {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static int manifest_page_erased(const uint8_t *page) {
+    /* Every byte is 0xFF if the page is equal to itself shifted by one */
+    return page[0] == 0xFF && memcmp(page, &page[1], TIXFS_PAGE_SIZE - 1) == 0;
+}
+
+/* vim: set tw=80 ft=c: */
@@ -0,0 +1,50 @@
+/**
+ * @file manifest.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Sidecar file describing an image, so that it can be checked after flashing
+ * without reading it all back: a CRC-32 of each page and of each erase block
+ * (4 pages), which pages are entirely erased (0xFF), and where each file is.
+ *
+ *     # tixfsgen manifest
+ *     page 0x04 0x1C291CA3
+ *     page 0x05 erased
+ *     ...
+ *     block 0x04 0x6B3D4F0E
+ *     ...
+ *     0 0x1F:0x4A00 35
+ *     1 0x08:0x4000 64 /
+ *     2 0x08:0x4047 12 /etc/motd
+ *
+ * The CRC is the same as the one used by zlib and PNG. Blocks are only listed
+ * if all 4 of their pages are in the image. The file lines are the same as in
+ * a layout map, so the manifest can also be used with --layout-from.
+ */
+
+#ifndef MANIFEST_H_
+#define MANIFEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tixfs.h"
+
+#define MANIFEST_HEADER "# tixfsgen manifest"
+
+/**
+ * Writes the manifest of an encoded image.
+ * @return 0 on success, -1 on error.
+ */
+int manifest_write(const tixfs_image *img, FILE *stream);
+
+/**
+ * Computes a CRC-32, continuing from an earlier one.
+ * @param crc CRC so far, or 0 to start.
+ */
+uint32_t manifest_crc32(uint32_t crc, const uint8_t *data, size_t size);
+
+#endif /* MANIFEST_H_ */
+
+/* vim: set tw=80 ft=c: */
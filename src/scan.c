@@ -0,0 +1,474 @@
+/**
+ * @file scan.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
+
+/**
+ * Directory entry read from one of the roots, before the roots are merged.
+ */
+typedef struct {
+    char *name;
+
+    /**
+     * Index of the root which the entry came from.
+     */
+    int layer;
+
+    /**
+     * Order in which the entry was read. This is used to keep the original
+     * readdir() order after the entries are merged.
+     */
+    int seq;
+
+    /**
+     * File type from readdir(), if it is known.
+     */
+    unsigned char type;
+
+    /**
+     * Whether this entry is a whiteout marker for name.
+     */
+    int whiteout;
+} scan_entry;
+
+/**
+ * Settings which are the same for the whole scan.
+ */
+typedef struct {
+    /**
+     * Whether to interpret whiteout markers.
+     */
+    int overlay;
+
+    const filter_list *filter;
+} scan_ctx;
+
+/**
+ * Child node paired with the sequence number of its entry, for sorting.
+ */
+typedef struct {
+    int seq;
+    scan_node *node;
+} scan_child;
+
+/* These count the calls for the statistics */
+static int scan_stat(const char *path, struct stat *st);
+static DIR *scan_opendir(const char *path);
+static struct dirent *scan_readdir(DIR *dirp);
+
+static void *scan_alloc(size_t size);
+static char *scan_join(const char *dir, const char *name);
+
+static scan_node *scan_new_node(const char *name, const char *path,
+        const struct stat *st);
+static void scan_add_child(scan_node *dir, scan_node *child);
+
+static int scan_entry_cmp(const void *a, const void *b);
+static int scan_child_cmp(const void *a, const void *b);
+
+/**
+ * Reads the entries of a directory, merging the entries of all roots that
+ * contain it.
+ * @param ctx Settings for the scan.
+ * @param dir Node of the directory to fill in.
+ * @param layers Paths of the directory in each root which contains it, from
+ * the first root to the last.
+ * @param layer_count Number of paths in layers.
+ * @param rel_path Path of the directory relative to the root ("" for the
+ * root).
+ */
+static void scan_dir(const scan_ctx *ctx, scan_node *dir,
+        char *const *layers, int layer_count, const char *rel_path);
+
+scan_node *scan_tree(char *const *roots, int root_count,
+        const filter_list *filter) {
+    scan_ctx ctx;
+    struct stat st;
+    scan_node *root;
+
+    if (!roots || root_count <= 0) {
+        return NULL;
+    }
+
+    /* Check every root first, so that a missing one is not silently left
+     * out of the overlay
+     */
+    for (int i = 0; i < root_count; i++) {
+        if (scan_stat(roots[i], &st) < 0) {
+            fprintf(stderr, "Error: %s: %s\n", roots[i], strerror(errno));
+            return NULL;
+        }
+
+        /* Only the last root can be a single file */
+        if (i < root_count - 1 && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Error: %s: %s\n", roots[i], strerror(ENOTDIR));
+            return NULL;
+        }
+    }
+
+    /* The last root decides what the root is. st is still from the loop. */
+    root = scan_new_node("", roots[root_count - 1], &st);
+    if (!S_ISDIR(st.st_mode)) {
+        return root;
+    }
+
+    ctx.overlay = root_count > 1;
+    ctx.filter = filter && filter->len > 0 ? filter : NULL;
+    scan_dir(&ctx, root, roots, root_count, "");
+
+    return root;
+}
+
+void scan_free(scan_node *node) {
+    if (!node) {
+        return;
+    }
+
+    for (int i = 0; i < node->child_count; i++) {
+        scan_free(node->children[i]);
+    }
+
+    free(node->children);
+    free(node->name);
+    free(node->path);
+    free(node);
+}
+
+static void scan_dir(const scan_ctx *ctx, scan_node *dir,
+        char *const *layers, int layer_count, const char *rel_path) {
+    DIR *dirp;
+    struct dirent *dentry;
+
+    /* Buffer for the relative path of each entry, to match against the filter.
+     * The directory part stays the same.
+     */
+    size_t rel_len = strlen(rel_path);
+    char *ent_rel_path = scan_alloc(rel_len + sizeof(dentry->d_name) + 2);
+    char *ent_rel_name = ent_rel_path;
+
+    if (rel_len > 0) {
+        memcpy(ent_rel_path, rel_path, rel_len);
+        ent_rel_path[rel_len] = '/';
+        ent_rel_name = &ent_rel_path[rel_len + 1];
+    }
+
+    int entry_count = 0;
+    int entry_cap = 16;
+    scan_entry *entries = scan_alloc(entry_cap * sizeof(entries[0]));
+
+    int seq = 0;
+
+    for (int layer = 0; layer < layer_count; layer++) {
+        int opaque = 0;
+        int layer_start = entry_count;
+
+        trace_begin("readdir", layers[layer]);
+        dirp = scan_opendir(layers[layer]);
+        if (!dirp) {
+            trace_end("readdir", NULL, 0);
+            fprintf(stderr,
+                    "Warning: Directory \"%s\" cannot be opened. Skipping.\n",
+                    layers[layer]);
+            continue;
+        }
+
+        while ((dentry = scan_readdir(dirp))) {
+            const char *name = dentry->d_name;
+            int whiteout = 0;
+
+            /* The ".." entry is added when writing the directory since whether
+             * or not it will show up in readdir() is implementation-dependent
+             */
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+
+            if (ctx->overlay) {
+                if (strcmp(name, SCAN_OPAQUE_MARKER) == 0) {
+                    opaque = 1;
+                    continue;
+                }
+
+                if (strncmp(name, SCAN_WHITEOUT_PREFIX,
+                            strlen(SCAN_WHITEOUT_PREFIX)) == 0) {
+                    name += strlen(SCAN_WHITEOUT_PREFIX);
+                    whiteout = 1;
+                }
+            }
+
+            /* Whiteouts are kept, since they only hide files */
+            if (ctx->filter && !whiteout) {
+                int is_dir = dentry->d_type == DT_DIR;
+
+                strcpy(ent_rel_name, name);
+
+                /* Only stat() if a pattern depends on it */
+                if (dentry->d_type == DT_UNKNOWN
+                        && ctx->filter->dir_only_count > 0) {
+                    struct stat st;
+                    char *path = scan_join(layers[layer], name);
+                    is_dir = scan_stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+                    free(path);
+                }
+
+                if (filter_excluded(ctx->filter, ent_rel_path, name, is_dir)) {
+                    continue;
+                }
+            }
+
+            if (entry_count == entry_cap) {
+                entry_cap *= 2;
+                entries = realloc(entries, entry_cap * sizeof(entries[0]));
+                if (!entries) {
+                    perror("Memory error");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            entries[entry_count].name = strdup(name);
+            if (!entries[entry_count].name) {
+                perror("Memory error");
+                exit(EXIT_FAILURE);
+            }
+            entries[entry_count].layer = layer;
+            entries[entry_count].seq = seq++;
+            entries[entry_count].type = dentry->d_type;
+            entries[entry_count].whiteout = whiteout;
+            entry_count++;
+        }
+
+        closedir(dirp);
+        trace_end("readdir", "entries", entry_count - layer_start);
+
+        /* An opaque directory hides everything from the earlier roots */
+        if (opaque && layer_start > 0) {
+            for (int i = 0; i < layer_start; i++) {
+                free(entries[i].name);
+            }
+
+            memmove(entries, &entries[layer_start],
+                    (entry_count - layer_start) * sizeof(entries[0]));
+            entry_count -= layer_start;
+        }
+    }
+
+    /* Group the entries by name, with the last root first in each group */
+    qsort(entries, entry_count, sizeof(entries[0]), scan_entry_cmp);
+
+    int child_count = 0;
+    scan_child *children = scan_alloc((entry_count + 1) * sizeof(children[0]));
+    char **sublayers = scan_alloc(layer_count * sizeof(sublayers[0]));
+
+    for (int group = 0, next; group < entry_count; group = next) {
+        const scan_entry *top = &entries[group];
+        int first_seq = top->seq;
+        struct stat st;
+
+        for (next = group + 1; next < entry_count
+                && strcmp(entries[next].name, top->name) == 0; next++) {
+            if (entries[next].seq < first_seq) {
+                first_seq = entries[next].seq;
+            }
+        }
+
+        if (top->whiteout) {
+            continue;
+        }
+
+        char *path = scan_join(layers[top->layer], top->name);
+        if (scan_stat(path, &st) < 0) {
+            free(path);
+            continue;
+        }
+
+        scan_node *child = scan_new_node(top->name, path, &st);
+        free(path);
+
+        if (S_ISDIR(st.st_mode)) {
+            /* Collect the same directory from earlier roots until one of them
+             * is hidden by a whiteout or is not a directory.
+             */
+            int sublayer_count = 0;
+            sublayers[sublayer_count++] = child->path;
+
+            for (int i = group + 1; i < next; i++) {
+                const scan_entry *lower = &entries[i];
+                if (lower->whiteout) {
+                    break;
+                }
+
+                char *lower_path = scan_join(layers[lower->layer],
+                        lower->name);
+                if (lower->type == DT_UNKNOWN) {
+                    struct stat lower_st;
+                    if (scan_stat(lower_path, &lower_st) < 0
+                            || !S_ISDIR(lower_st.st_mode)) {
+                        free(lower_path);
+                        break;
+                    }
+                } else if (lower->type != DT_DIR) {
+                    free(lower_path);
+                    break;
+                }
+
+                sublayers[sublayer_count++] = lower_path;
+            }
+
+            /* They were added from last to first */
+            for (int i = 0; i < sublayer_count / 2; i++) {
+                char *tmp = sublayers[i];
+                sublayers[i] = sublayers[sublayer_count - 1 - i];
+                sublayers[sublayer_count - 1 - i] = tmp;
+            }
+
+            char **child_layers = scan_alloc(
+                    sublayer_count * sizeof(child_layers[0]));
+            memcpy(child_layers, sublayers,
+                    sublayer_count * sizeof(child_layers[0]));
+
+            strcpy(ent_rel_name, top->name);
+            scan_dir(ctx, child, child_layers, sublayer_count, ent_rel_path);
+
+            /* The last one is child->path, which is owned by the node */
+            for (int i = 0; i < sublayer_count - 1; i++) {
+                free(child_layers[i]);
+            }
+            free(child_layers);
+        }
+
+        children[child_count].seq = first_seq;
+        children[child_count].node = child;
+        child_count++;
+    }
+
+    /* Restore the order in which the entries were read */
+    qsort(children, child_count, sizeof(children[0]), scan_child_cmp);
+    for (int i = 0; i < child_count; i++) {
+        scan_add_child(dir, children[i].node);
+    }
+
+    for (int i = 0; i < entry_count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+    free(children);
+    free(sublayers);
+    free(ent_rel_path);
+}
+
+static int scan_stat(const char *path, struct stat *st) {
+    int ret;
+
+    stats.stat_calls++;
+    trace_begin("stat", path);
+    ret = stat(path, st);
+    trace_end("stat", NULL, 0);
+
+    return ret;
+}
+
+static DIR *scan_opendir(const char *path) {
+    stats.open_calls++;
+    return opendir(path);
+}
+
+static struct dirent *scan_readdir(DIR *dirp) {
+    stats.readdir_calls++;
+    return readdir(dirp);
+}
+
+static void *scan_alloc(size_t size) {
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+
+    return ptr;
+}
+
+static char *scan_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = scan_alloc(dir_len + name_len + 2);
+
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(&path[dir_len + 1], name, name_len + 1);
+
+    return path;
+}
+
+static scan_node *scan_new_node(const char *name, const char *path,
+        const struct stat *st) {
+    scan_node *node = scan_alloc(sizeof(*node));
+
+    node->name = strdup(name);
+    node->path = strdup(path);
+    if (!node->name || !node->path) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+
+    node->st = *st;
+
+    node->child_count = 0;
+    node->child_cap = 0;
+    node->children = NULL;
+
+    return node;
+}
+
+static void scan_add_child(scan_node *dir, scan_node *child) {
+    if (dir->child_count == dir->child_cap) {
+        dir->child_cap = dir->child_cap ? dir->child_cap * 2 : 4;
+        dir->children = realloc(dir->children,
+                dir->child_cap * sizeof(dir->children[0]));
+        if (!dir->children) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    dir->children[dir->child_count++] = child;
+}
+
+/**
+ * Orders entries by name, then from the last root to the first. Within the
+ * same root, a file comes before the whiteout marker with the same name, so
+ * that the whiteout only hides the earlier roots.
+ */
+static int scan_entry_cmp(const void *a, const void *b) {
+    const scan_entry *ea = a;
+    const scan_entry *eb = b;
+    int cmp = strcmp(ea->name, eb->name);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    if (ea->layer != eb->layer) {
+        return eb->layer - ea->layer;
+    }
+
+    return ea->whiteout - eb->whiteout;
+}
+
+static int scan_child_cmp(const void *a, const void *b) {
+    return ((const scan_child *) a)->seq - ((const scan_child *) b)->seq;
+}
+
+/* vim: set tw=80 ft=c: */
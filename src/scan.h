@@ -0,0 +1,79 @@
+/**
+ * @file scan.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <sys/stat.h>
+
+#include "filter.h"
+
+/**
+ * Prefix of a whiteout marker. When overlaying several roots, a file named
+ * ".wh.<name>" in one root hides "<name>" in all of the roots before it.
+ */
+#define SCAN_WHITEOUT_PREFIX ".wh."
+
+/**
+ * Whiteout marker for a whole directory. If a directory contains this file,
+ * none of the entries from the same directory in earlier roots are used.
+ */
+#define SCAN_OPAQUE_MARKER ".wh..wh..opq"
+
+/**
+ * File in the merged view of the root directories.
+ */
+typedef struct scan_node {
+    /**
+     * Name of the file in its parent directory.
+     */
+    char *name;
+
+    /**
+     * Path of the file in the local filesystem. For directories which are
+     * merged from several roots, this is the one in the last root.
+     */
+    char *path;
+
+    /**
+     * Result of stat() on path.
+     */
+    struct stat st;
+
+    /**
+     * Entries of a directory, in the order in which they were first read.
+     */
+    int child_count;
+    int child_cap;
+    struct scan_node **children;
+} scan_node;
+
+/**
+ * Scans one or more root directories into a tree in memory.
+ * The roots are overlaid in order: if the same path exists in several roots,
+ * the last one is used, unless both are directories, in which case their
+ * entries are merged. Whiteout markers are only interpreted when there is more
+ * than one root.
+ * Files excluded by the filter are skipped before they are stat()ed, and
+ * excluded directories are not read at all.
+ * @param roots Paths of the root directories.
+ * @param root_count Number of roots.
+ * @param filter Patterns of files to leave out, or NULL to keep everything.
+ * @return Root of the merged tree, or NULL (after printing an error) if any
+ * of the roots does not exist or one other than the last is not a directory.
+ */
+scan_node *scan_tree(char *const *roots, int root_count,
+        const filter_list *filter);
+
+/**
+ * Frees a tree returned by scan_tree().
+ * @param node Root of the tree.
+ */
+void scan_free(scan_node *node);
+
+#endif /* SCAN_H_ */
+
+/* vim: set tw=80 ft=c: */
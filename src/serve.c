@@ -0,0 +1,724 @@
+/**
+ * @file serve.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "serve.h"
+
+/**
+ * What a file looked like when it was cached. If any of this changes, the file
+ * is considered changed.
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+} serve_stamp;
+
+/**
+ * Cached input or output file.
+ */
+typedef struct {
+    /**
+     * Absolute path of the file.
+     */
+    char *path;
+    serve_stamp stamp;
+
+    /**
+     * Contents of an input file.
+     */
+    long len;
+    uint8_t *data;
+
+    /**
+     * Digest and Intel hex statistics of an output file.
+     */
+    uint64_t digest;
+    long records;
+    long bytes;
+} serve_entry;
+
+/**
+ * Hash table of entries by path, with linear probing.
+ */
+typedef struct {
+    int cap;
+    int count;
+    serve_entry **entries;
+} serve_table;
+
+enum {
+    SERVE_FILE,
+    SERVE_OUTPUT,
+};
+
+/**
+ * Entry sent from a build back to the server, followed by the path and, for
+ * input files, the contents.
+ */
+typedef struct {
+    int kind;
+    serve_stamp stamp;
+    uint64_t digest;
+    long records;
+    long bytes;
+    long len;
+    size_t path_len;
+} serve_record;
+
+/**
+ * First part of a request, sent along with the client's standard streams and
+ * followed by the working directory and the arguments, each terminated by a
+ * NUL.
+ */
+typedef struct {
+    uint32_t len;
+    int32_t argc;
+} serve_header;
+
+static serve_table files;
+static serve_table outputs;
+
+/**
+ * Pipe to send new entries to the server through, or -1 when not building
+ * for a server.
+ */
+static int cache_fd = -1;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Working directory of the client, for making paths absolute.
+ */
+static const char *serve_cwd;
+
+/**
+ * Reads a request, builds it in a child process, and sends back the exit
+ * status.
+ */
+static void serve_request(int conn, int sock, serve_build build);
+
+/**
+ * Adds the entries sent by a build to the caches until it exits.
+ */
+static void serve_receive(int fd);
+
+static serve_entry *serve_table_find(const serve_table *table,
+        const char *path);
+
+/**
+ * Adds an entry, replacing any with the same path.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int serve_table_put(serve_table *table, serve_entry *entry);
+
+static void serve_entry_free(serve_entry *entry);
+
+static void serve_set_stamp(serve_stamp *stamp, const struct stat *st);
+static int serve_stamp_equal(const serve_stamp *a, const serve_stamp *b);
+
+/**
+ * Makes a path absolute using the client's working directory.
+ * @return The path, which has to be freed, or NULL if out of memory.
+ */
+static char *serve_abs_path(const char *path);
+
+/**
+ * Sends an entry to the server.
+ */
+static void serve_send(const serve_record *record, const char *path,
+        const uint8_t *data);
+
+static int serve_write_all(int fd, const void *buf, size_t size);
+
+/**
+ * Reads exactly size bytes.
+ * @return 0 on success, -1 on error or at the end of the file.
+ */
+static int serve_read_all(int fd, void *buf, size_t size);
+
+int serve_run(const char *socket_path, serve_build build) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int sock;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+
+    /* Only a socket left over from an earlier server is replaced */
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket\n",
+                    socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(sock, 16) < 0) {
+        fprintf(stderr, "Error: Could not listen on %s: %s\n", socket_path,
+                strerror(errno));
+        return -1;
+    }
+
+    /* A client going away should not stop the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Requests are built one at a time, since each one can use all of the
+     * cores with -j anyway
+     */
+    for (;;) {
+        int conn = accept(sock, NULL, NULL);
+
+        if (conn < 0) {
+            if (errno != EINTR) {
+                perror("Warning: accept");
+            }
+            continue;
+        }
+
+        serve_request(conn, sock, build);
+        close(conn);
+    }
+}
+
+int serve_client(const char *socket_path, int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    serve_header header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    char *cwd;
+    char *payload;
+    size_t len;
+    uint8_t status;
+    int sock;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr,
+                sizeof(addr)) < 0) {
+        fprintf(stderr, "Error: Could not connect to %s: %s\n", socket_path,
+                strerror(errno));
+        return -1;
+    }
+
+    cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("Error: getcwd");
+        close(sock);
+        return -1;
+    }
+
+    len = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+
+    payload = malloc(len);
+    if (!payload) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+
+    len = 0;
+    strcpy(payload, cwd);
+    len += strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        strcpy(&payload[len], argv[i]);
+        len += strlen(argv[i]) + 1;
+    }
+    free(cwd);
+
+    header.len = len;
+    header.argc = argc;
+
+    /* The server writes to the client's streams directly */
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(header)
+            || serve_write_all(sock, payload, len) < 0
+            || serve_read_all(sock, &status, 1) < 0) {
+        fprintf(stderr, "Error: Lost the connection to %s\n", socket_path);
+        free(payload);
+        close(sock);
+        return -1;
+    }
+
+    free(payload);
+    close(sock);
+    return status;
+}
+
+const uint8_t *serve_find_file(const char *path, const struct stat *st,
+        long *len) {
+    serve_stamp stamp;
+    serve_entry *entry;
+    char *abs_path;
+
+    if (files.count == 0) {
+        return NULL;
+    }
+
+    abs_path = serve_abs_path(path);
+    if (!abs_path) {
+        return NULL;
+    }
+
+    entry = serve_table_find(&files, abs_path);
+    free(abs_path);
+
+    serve_set_stamp(&stamp, st);
+    if (!entry || !serve_stamp_equal(&entry->stamp, &stamp)) {
+        return NULL;
+    }
+
+    *len = entry->len;
+    return entry->data;
+}
+
+int serve_active(void) {
+    return cache_fd >= 0;
+}
+
+void serve_add_file(const char *path, const struct stat *st,
+        const uint8_t *data, long len) {
+    serve_record record;
+    char *abs_path;
+
+    if (cache_fd < 0) {
+        return;
+    }
+
+    abs_path = serve_abs_path(path);
+    if (!abs_path) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.kind = SERVE_FILE;
+    serve_set_stamp(&record.stamp, st);
+    record.len = len;
+    record.path_len = strlen(abs_path);
+
+    serve_send(&record, abs_path, data);
+    free(abs_path);
+}
+
+int serve_find_output(const char *filename, uint64_t digest, long *records,
+        long *bytes) {
+    serve_stamp stamp;
+    serve_entry *entry;
+    struct stat st;
+    char *abs_path;
+
+    if (outputs.count == 0 || stat(filename, &st) < 0) {
+        return 0;
+    }
+
+    abs_path = serve_abs_path(filename);
+    if (!abs_path) {
+        return 0;
+    }
+
+    entry = serve_table_find(&outputs, abs_path);
+    free(abs_path);
+
+    serve_set_stamp(&stamp, &st);
+    if (!entry || entry->digest != digest
+            || !serve_stamp_equal(&entry->stamp, &stamp)) {
+        return 0;
+    }
+
+    *records = entry->records;
+    *bytes = entry->bytes;
+    return 1;
+}
+
+void serve_add_output(const char *filename, uint64_t digest, long records,
+        long bytes) {
+    serve_record record;
+    struct stat st;
+    char *abs_path;
+
+    if (cache_fd < 0 || stat(filename, &st) < 0) {
+        return;
+    }
+
+    abs_path = serve_abs_path(filename);
+    if (!abs_path) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.kind = SERVE_OUTPUT;
+    serve_set_stamp(&record.stamp, &st);
+    record.digest = digest;
+    record.records = records;
+    record.bytes = bytes;
+    record.path_len = strlen(abs_path);
+
+    serve_send(&record, abs_path, NULL);
+    free(abs_path);
+}
+
+uint64_t serve_digest(uint64_t digest, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        digest ^= bytes[i];
+        digest *= 0x100000001B3ULL;
+    }
+
+    return digest;
+}
+
+static void serve_request(int conn, int sock, serve_build build) {
+    serve_header header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[3] = {-1, -1, -1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    int pipe_fds[2];
+    char *payload = NULL;
+    char **argv = NULL;
+    uint8_t status = EXIT_FAILURE;
+    pid_t pid;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(conn, &msg, 0) != sizeof(header)) {
+        return;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    if (fds[0] < 0 || header.argc < 1) {
+        goto done;
+    }
+
+    payload = malloc(header.len + 1);
+    argv = calloc(header.argc + 1, sizeof(argv[0]));
+    if (!payload || !argv || serve_read_all(conn, payload, header.len) < 0) {
+        goto done;
+    }
+    payload[header.len] = 0;
+
+    /* The working directory, then the arguments */
+    size_t pos = strlen(payload) + 1;
+    for (int i = 0; i < header.argc; i++) {
+        if (pos >= header.len) {
+            goto done;
+        }
+
+        argv[i] = &payload[pos];
+        pos += strlen(argv[i]) + 1;
+    }
+
+    if (pipe(pipe_fds) < 0) {
+        goto done;
+    }
+
+    fflush(NULL);
+    pid = fork();
+    if (pid == 0) {
+        close(sock);
+        close(conn);
+        close(pipe_fds[0]);
+        signal(SIGPIPE, SIG_DFL);
+
+        for (int i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+
+        if (chdir(payload) < 0) {
+            fprintf(stderr, "Error: Could not change to directory %s\n",
+                    payload);
+            exit(EXIT_FAILURE);
+        }
+
+        cache_fd = pipe_fds[1];
+        serve_cwd = payload;
+        exit(build(header.argc, argv));
+    }
+
+    close(pipe_fds[1]);
+    if (pid > 0) {
+        int wstatus;
+
+        serve_receive(pipe_fds[0]);
+        if (waitpid(pid, &wstatus, 0) == pid && WIFEXITED(wstatus)) {
+            status = WEXITSTATUS(wstatus);
+        }
+    }
+    close(pipe_fds[0]);
+
+done:
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    serve_write_all(conn, &status, 1);
+    free(payload);
+    free(argv);
+}
+
+static void serve_receive(int fd) {
+    serve_record record;
+
+    while (serve_read_all(fd, &record, sizeof(record)) == 0) {
+        serve_entry *entry = calloc(1, sizeof(*entry));
+
+        if (!entry) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+
+        entry->path = malloc(record.path_len + 1);
+        if (record.kind == SERVE_FILE) {
+            entry->data = malloc(record.len ? record.len : 1);
+        }
+
+        if (!entry->path || (record.kind == SERVE_FILE && !entry->data)) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+
+        if (serve_read_all(fd, entry->path, record.path_len) < 0
+                || (record.kind == SERVE_FILE
+                    && serve_read_all(fd, entry->data, record.len) < 0)) {
+            serve_entry_free(entry);
+            break;
+        }
+        entry->path[record.path_len] = 0;
+
+        entry->stamp = record.stamp;
+        entry->len = record.len;
+        entry->digest = record.digest;
+        entry->records = record.records;
+        entry->bytes = record.bytes;
+
+        if (serve_table_put(record.kind == SERVE_FILE ? &files : &outputs,
+                    entry) < 0) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Drain anything after a partial entry so the build is not blocked */
+    char buf[4096];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        continue;
+    }
+}
+
+static uint64_t serve_hash_path(const char *path) {
+    return serve_digest(SERVE_DIGEST_INIT, path, strlen(path));
+}
+
+static serve_entry *serve_table_find(const serve_table *table,
+        const char *path) {
+    if (table->cap == 0) {
+        return NULL;
+    }
+
+    for (int i = serve_hash_path(path) & (table->cap - 1);
+            table->entries[i]; i = (i + 1) & (table->cap - 1)) {
+        if (strcmp(table->entries[i]->path, path) == 0) {
+            return table->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int serve_table_put(serve_table *table, serve_entry *entry) {
+    int i;
+
+    /* Keep the table at most half full */
+    if ((table->count + 1) * 2 > table->cap) {
+        serve_table old = *table;
+
+        table->cap = table->cap ? table->cap * 2 : 256;
+        table->count = 0;
+        table->entries = calloc(table->cap, sizeof(table->entries[0]));
+        if (!table->entries) {
+            return -1;
+        }
+
+        for (int j = 0; j < old.cap; j++) {
+            if (old.entries[j]) {
+                serve_table_put(table, old.entries[j]);
+            }
+        }
+        free(old.entries);
+    }
+
+    for (i = serve_hash_path(entry->path) & (table->cap - 1);
+            table->entries[i]; i = (i + 1) & (table->cap - 1)) {
+        if (strcmp(table->entries[i]->path, entry->path) == 0) {
+            serve_entry_free(table->entries[i]);
+            table->entries[i] = entry;
+            return 0;
+        }
+    }
+
+    table->entries[i] = entry;
+    table->count++;
+    return 0;
+}
+
+static void serve_entry_free(serve_entry *entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+static void serve_set_stamp(serve_stamp *stamp, const struct stat *st) {
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime = st->st_mtim;
+    stamp->ctime = st->st_ctim;
+}
+
+static int serve_stamp_equal(const serve_stamp *a, const serve_stamp *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+        && a->mtime.tv_sec == b->mtime.tv_sec
+        && a->mtime.tv_nsec == b->mtime.tv_nsec
+        && a->ctime.tv_sec == b->ctime.tv_sec
+        && a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+static char *serve_abs_path(const char *path) {
+    char *abs_path;
+
+    if (path[0] == '/' || !serve_cwd) {
+        return strdup(path);
+    }
+
+    abs_path = malloc(strlen(serve_cwd) + 1 + strlen(path) + 1);
+    if (abs_path) {
+        sprintf(abs_path, "%s/%s", serve_cwd, path);
+    }
+
+    return abs_path;
+}
+
+static void serve_send(const serve_record *record, const char *path,
+        const uint8_t *data) {
+    pthread_mutex_lock(&cache_lock);
+
+    /* If the server stopped reading, there is nothing to do but stop
+     * sending
+     */
+    if (serve_write_all(cache_fd, record, sizeof(*record)) < 0
+            || serve_write_all(cache_fd, path, record->path_len) < 0
+            || (data && serve_write_all(cache_fd, data, record->len) < 0)) {
+        close(cache_fd);
+        cache_fd = -1;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int serve_write_all(int fd, const void *buf, size_t size) {
+    const char *pos = buf;
+
+    while (size > 0) {
+        ssize_t ret = write(fd, pos, size);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return -1;
+        }
+
+        pos += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+static int serve_read_all(int fd, void *buf, size_t size) {
+    char *pos = buf;
+
+    while (size > 0) {
+        ssize_t ret = read(fd, pos, size);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return -1;
+        }
+
+        pos += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+/* vim: set tw=80 ft=c: */
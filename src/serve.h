@@ -0,0 +1,100 @@
+/**
+ * @file serve.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Build server which keeps the contents of files and the state of outputs from
+ * earlier builds, so that rebuilding after a small change does not have to
+ * read or write everything again.
+ *
+ * Each request is built in a child process with the client's arguments,
+ * working directory, and standard streams, so that nothing from one build
+ * carries over to the next except through the caches. The child sends the
+ * files it read and the outputs it wrote back to the server, which adds them
+ * to the caches for the next requests.
+ */
+
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * Builds with the given arguments, as from the command line.
+ * @return Exit status.
+ */
+typedef int (*serve_build)(int argc, char *argv[]);
+
+/**
+ * Listens for requests on a Unix socket until killed.
+ * @param socket_path Path of the socket. An existing socket there is replaced.
+ * @param build Function to build each request with.
+ * @return -1 if the socket could not be set up.
+ */
+int serve_run(const char *socket_path, serve_build build);
+
+/**
+ * Sends a build request to a server and waits for it to finish. The server
+ * writes to this process's stdout and stderr directly.
+ * @param socket_path Path of the server's socket.
+ * @param argc Number of arguments, including the program name.
+ * @param argv Arguments for the build.
+ * @return Exit status of the build, or -1 if the server could not be reached.
+ */
+int serve_client(const char *socket_path, int argc, char *argv[]);
+
+/**
+ * Checks whether this build was requested from a server, so that there are
+ * caches to look things up in and add them to.
+ */
+int serve_active(void);
+
+/**
+ * Gets the contents of a file from an earlier build, if it has not changed
+ * since then.
+ * @param path Path of the file on the host.
+ * @param st Current status of the file.
+ * @param len Set to the length of the contents.
+ * @return The contents, or NULL if they are not cached.
+ */
+const uint8_t *serve_find_file(const char *path, const struct stat *st,
+        long *len);
+
+/**
+ * Adds the contents of a file which were read during a build.
+ * This does nothing if the build was not requested from a server.
+ */
+void serve_add_file(const char *path, const struct stat *st,
+        const uint8_t *data, long len);
+
+/**
+ * Checks whether an output file was written by an earlier build with the same
+ * contents and has not changed since.
+ * @param filename Output file, relative to the current directory.
+ * @param digest Digest of everything the output depends on.
+ * @param records Set to the number of Intel hex records in the file.
+ * @param bytes Set to the size of the file.
+ * @return Non-zero if the file does not have to be written again.
+ */
+int serve_find_output(const char *filename, uint64_t digest, long *records,
+        long *bytes);
+
+/**
+ * Adds an output file which was written during a build. This can be called
+ * from several threads at once.
+ */
+void serve_add_output(const char *filename, uint64_t digest, long records,
+        long bytes);
+
+/**
+ * Computes a 64-bit FNV-1a digest, continuing from an earlier one.
+ * @param digest Digest so far, or SERVE_DIGEST_INIT.
+ */
+uint64_t serve_digest(uint64_t digest, const void *data, size_t size);
+
+#define SERVE_DIGEST_INIT 0xCBF29CE484222325ULL
+
+#endif /* SERVE_H_ */
+
+/* vim: set tw=80 ft=c: */
@@ -0,0 +1,144 @@
+/**
+ * @file stats.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "stats.h"
+
+tixfs_stats stats;
+
+static const char *const phase_names[STATS_PHASE_COUNT] = {
+    [STATS_SCAN] = "scan",
+    [STATS_READ] = "read",
+    [STATS_LAYOUT] = "layout",
+    [STATS_ENCODE] = "encode",
+    [STATS_WRITE] = "write",
+};
+
+#ifdef STATS_COUNT_ALLOCS
+/* Allocations are counted by having the linker redirect calls to these
+ * functions here (see WRAP_LDFLAGS in the Makefile).
+ */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+#endif
+
+double stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_start(stats_phase phase) {
+    stats.phase_start[phase] = stats_now();
+}
+
+void stats_stop(stats_phase phase) {
+    stats.phase_time[phase] += stats_now() - stats.phase_start[phase];
+}
+
+void stats_finish(void) {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        /* This is in KiB on Linux */
+        stats.peak_rss_kb = usage.ru_maxrss;
+    }
+}
+
+void stats_print(FILE *stream) {
+    double total = 0;
+
+    fprintf(stream, "Phase times:\n");
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(stream, "  %-8s %10.6f s\n", phase_names[i],
+                stats.phase_time[i]);
+        total += stats.phase_time[i];
+    }
+    fprintf(stream, "  %-8s %10.6f s\n", "total", total);
+
+    fprintf(stream,
+            "Files: %ld regular, %ld directories, %ld devices\n"
+            "Calls: %ld stat, %ld readdir, %ld open, %ld read\n"
+            "Bytes read: %ld\n"
+            "Filesystem: %ld payload bytes, %ld padding bytes\n"
+            "Intel hex: %ld records, %ld bytes\n",
+            stats.files, stats.dirs, stats.devices,
+            stats.stat_calls, stats.readdir_calls,
+            stats.open_calls, stats.read_calls,
+            stats.bytes_read,
+            stats.payload_bytes, stats.padding_bytes,
+            stats.ihex_records, stats.ihex_bytes);
+#ifdef STATS_COUNT_ALLOCS
+    fprintf(stream, "Allocations: %ld\n", stats.allocations);
+#else
+    fprintf(stream, "Allocations: not counted\n");
+#endif
+    fprintf(stream, "Peak RSS: %ld KiB\n", stats.peak_rss_kb);
+}
+
+void stats_print_json(FILE *stream) {
+    double total = 0;
+
+    fprintf(stream, "{\n  \"phases\": {\n");
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(stream, "    \"%s\": %.9f%s\n", phase_names[i],
+                stats.phase_time[i], i < STATS_PHASE_COUNT - 1 ? "," : "");
+        total += stats.phase_time[i];
+    }
+    fprintf(stream, "  },\n");
+
+    fprintf(stream,
+            "  \"total\": %.9f,\n"
+            "  \"files\": %ld,\n"
+            "  \"dirs\": %ld,\n"
+            "  \"devices\": %ld,\n"
+            "  \"stat_calls\": %ld,\n"
+            "  \"readdir_calls\": %ld,\n"
+            "  \"open_calls\": %ld,\n"
+            "  \"read_calls\": %ld,\n"
+            "  \"bytes_read\": %ld,\n"
+            "  \"payload_bytes\": %ld,\n"
+            "  \"padding_bytes\": %ld,\n"
+            "  \"ihex_records\": %ld,\n"
+            "  \"ihex_bytes\": %ld,\n",
+            total,
+            stats.files, stats.dirs, stats.devices,
+            stats.stat_calls, stats.readdir_calls,
+            stats.open_calls, stats.read_calls,
+            stats.bytes_read,
+            stats.payload_bytes, stats.padding_bytes,
+            stats.ihex_records, stats.ihex_bytes);
+#ifdef STATS_COUNT_ALLOCS
+    fprintf(stream, "  \"allocations\": %ld,\n", stats.allocations);
+#else
+    fprintf(stream, "  \"allocations\": null,\n");
+#endif
+    fprintf(stream, "  \"peak_rss_kb\": %ld\n}\n", stats.peak_rss_kb);
+}
+
+/* vim: set tw=80 ft=c: */
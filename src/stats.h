@@ -0,0 +1,112 @@
+/**
+ * @file stats.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+
+/**
+ * Phases of building a filesystem, in the order they run.
+ */
+typedef enum stats_phase {
+    STATS_SCAN,     /**< Reading directories and stat()ing files */
+    STATS_READ,     /**< Reading the contents of files */
+    STATS_LAYOUT,   /**< Deciding where each file goes */
+    STATS_ENCODE,   /**< Writing the filesystem into a memory image */
+    STATS_WRITE,    /**< Writing the image in Intel hex format */
+    STATS_PHASE_COUNT,
+} stats_phase;
+
+/**
+ * Counters for one run. They are updated whether or not they are reported,
+ * since it costs next to nothing.
+ */
+typedef struct tixfs_stats {
+    /**
+     * Total time spent in each phase, in seconds.
+     */
+    double phase_time[STATS_PHASE_COUNT];
+
+    /**
+     * Time at which each phase was last started, in seconds.
+     */
+    double phase_start[STATS_PHASE_COUNT];
+
+    long files;
+    long dirs;
+    long devices;
+
+    long stat_calls;
+    long readdir_calls;
+    long open_calls;
+    long read_calls;
+    long bytes_read;
+
+    /**
+     * Bytes of inodes and file data in the filesystem, including the inode
+     * file.
+     */
+    long payload_bytes;
+
+    /**
+     * Bytes left empty (0xFF) in the pages holding the filesystem, not
+     * counting the anchor block.
+     */
+    long padding_bytes;
+
+    long ihex_records;
+    long ihex_bytes;
+
+    /**
+     * Number of calls to malloc(), calloc(), and realloc(). These are only
+     * counted when built with STATS_COUNT_ALLOCS.
+     */
+    long allocations;
+
+    /**
+     * Peak resident set size, in KiB. This is filled in by stats_finish().
+     */
+    long peak_rss_kb;
+} tixfs_stats;
+
+extern tixfs_stats stats;
+
+/**
+ * Gets the value of a monotonic clock.
+ * @return Time in seconds from some unspecified starting point.
+ */
+double stats_now(void);
+
+/**
+ * Starts timing a phase.
+ */
+void stats_start(stats_phase phase);
+
+/**
+ * Stops timing a phase, adding the time since stats_start() to its total. A
+ * phase can be timed several times.
+ */
+void stats_stop(stats_phase phase);
+
+/**
+ * Fills in the values which are only read at the end of the run.
+ */
+void stats_finish(void);
+
+/**
+ * Prints the statistics in a human-readable format.
+ */
+void stats_print(FILE *stream);
+
+/**
+ * Prints the statistics as a JSON object, with each value on its own line.
+ */
+void stats_print_json(FILE *stream);
+
+#endif /* STATS_H_ */
+
+/* vim: set tw=80 ft=c: */
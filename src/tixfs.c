@@ -0,0 +1,2254 @@
+/**
+ * @file tixfs.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tixfs.h"
+
+/**
+ * Size of the chunks that file contents are allocated from.
+ */
+#define TIXFS_CHUNK_SIZE (4 * TIXFS_PAGE_SIZE)
+
+/**
+ * File in the filesystem being built. The nodes are kept in an array and refer
+ * to each other by their index in it.
+ */
+typedef struct {
+    tixfs_inode inode;
+    char name[TIXFS_NAME_MAX];
+
+    /**
+     * Index of the parent directory. The root is its own parent.
+     */
+    int parent;
+
+    /**
+     * Entries of a directory, as a linked list in the order they were added.
+     */
+    int first_child, last_child;
+    int next_sibling;
+
+    /**
+     * Contents of a regular file or the device numbers of a device. The
+     * contents of directories depend on the inode numbers, so they are only
+     * generated when encoding.
+     */
+    uint8_t *data;
+
+    /**
+     * Whether the file is in the builder's hot list.
+     */
+    int hot;
+} tixfs_node;
+
+/**
+ * Block of memory that file contents are allocated from, so that there is not
+ * an allocation for every file.
+ */
+typedef struct tixfs_chunk {
+    struct tixfs_chunk *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+} tixfs_chunk;
+
+struct tixfs_builder {
+    int node_count;
+    int node_cap;
+    tixfs_node *nodes;
+
+    /**
+     * Chunks for file contents, with the one being allocated from first.
+     */
+    tixfs_chunk *chunks;
+
+    /**
+     * Files to place first, in order.
+     */
+    int hot_len;
+    int hot_cap;
+    int *hot;
+};
+
+struct tixfs_image {
+    /**
+     * Builder being laid out. This is only used until the image is encoded.
+     */
+    const tixfs_builder *builder;
+
+    uint8_t start_page, end_page;
+
+    tix_far_ptr head, tail;
+
+    /**
+     * Last page that has to be output, which is the end of the block
+     * containing the tail.
+     */
+    uint8_t last_page;
+
+    /**
+     * Number of inodes, including the inode file (inode 0).
+     */
+    int inode_count;
+
+    /**
+     * Inode number of each node.
+     */
+    uint16_t *inode_nums;
+
+    /**
+     * Location of each inode, indexed by inode number.
+     */
+    tix_far_ptr *inodes;
+
+    long payload_bytes;
+    long padding_bytes;
+
+    /**
+     * Previous image being appended to, or NULL. This is only used until the
+     * image is encoded.
+     */
+    const tixfs_prev *base;
+
+    /**
+     * Contents of the pages from start_page to last_page, once encoded.
+     */
+    uint8_t *data;
+};
+
+/**
+ * Range of offsets into a page.
+ */
+typedef struct {
+    uint16_t start, end;
+} tixfs_extent;
+
+/**
+ * Free space in each page from the head on, for laying out around files that
+ * stay where they were. The extents of each page are kept in order.
+ */
+typedef struct {
+    int page_count;
+    struct {
+        int len;
+        int cap;
+        tixfs_extent *extents;
+    } *pages;
+} tixfs_space;
+
+/**
+ * File in a previous layout.
+ */
+typedef struct {
+    /**
+     * Path from the root, or NULL for the inode file.
+     */
+    char *path;
+    uint16_t inode_num;
+    tix_far_ptr loc;
+    uint16_t size;
+} tixfs_prev_file;
+
+struct tixfs_prev {
+    int len;
+    int cap;
+    tixfs_prev_file *files;
+
+    /**
+     * Contents of the pages from the anchor block to the end of the block
+     * containing the tail, if the layout was loaded from an image. Otherwise,
+     * this is NULL and the layout cannot be appended to.
+     */
+    uint8_t *pages;
+    uint8_t start_page;
+    uint8_t last_page;
+
+    /**
+     * End of the last file in the image.
+     */
+    tix_far_ptr tail;
+};
+
+/**
+ * State of tixfs_walk().
+ */
+typedef struct {
+    tixfs_page_reader read_page;
+    void *page_ctx;
+    tixfs_visitor visit;
+    void *ctx;
+
+    /**
+     * Location of each inode from the inode file, indexed by inode number.
+     */
+    int inode_cap;
+    tix_far_ptr *locs;
+    uint8_t *valid;
+
+    /**
+     * Directories which have already been walked, indexed by inode number.
+     */
+    uint8_t *entered;
+
+    /**
+     * Path of the current file.
+     */
+    char *path;
+    int path_len;
+    int path_cap;
+} tixfs_walker;
+
+/**
+ * Allocates memory for file contents from the builder's chunks.
+ */
+static uint8_t *tixfs_chunk_alloc(tixfs_builder *b, size_t size);
+
+/**
+ * Gives back the end of the last allocation from tixfs_chunk_alloc().
+ */
+static void tixfs_chunk_shrink(tixfs_builder *b, size_t unused);
+
+/**
+ * Adds a file to the tree.
+ * @param parent Index of the parent directory, or TIXFS_NO_PARENT to add the
+ * root.
+ * @param inode Inode of the file. For directories, the size and number of
+ * links are filled in from the entries.
+ * @return Index of the new node, or a negative error code.
+ */
+static int tixfs_add_node(tixfs_builder *b, int parent, const char *name,
+        const tixfs_inode *inode);
+
+static void tixfs_number_inodes(tixfs_image *img, int index);
+static int tixfs_place_files(tixfs_image *img, int index);
+
+/**
+ * Lays out the files one after the other: inode numbers are given in pre-order
+ * and the files are placed in post-order, followed by the inode file.
+ */
+static int tixfs_layout_seq(tixfs_image *img);
+
+/**
+ * Lays out each directory on the same page as as many of its files as fit:
+ * inode numbers are given to a directory, then its files, then its
+ * subdirectories, and the files are placed in the same order.
+ */
+static int tixfs_layout_cluster(tixfs_image *img);
+static void tixfs_number_cluster(tixfs_image *img, int index);
+static int tixfs_is_dir(const tixfs_node *node);
+
+/**
+ * Places a directory and its files, then the subdirectories.
+ * @param from First page to look for space in.
+ * @param overflow Files which do not fit on the directory's page are added to
+ * this, to be placed after everything else.
+ */
+static int tixfs_place_cluster(tixfs_image *img, tixfs_space *space,
+        int index, uint8_t from, int *overflow, int *overflow_len);
+
+/**
+ * Lays out the files around where they were in a previous layout.
+ */
+static int tixfs_layout_prev(tixfs_image *img, const tixfs_prev *prev);
+
+/**
+ * Gives files the inode numbers they had in a previous layout where possible,
+ * and the unused numbers to the rest.
+ * @param match Set to the file in the previous layout with the same path as
+ * each node, or NULL.
+ * @param prev_if Set to the inode file of the previous layout, or NULL.
+ */
+static int tixfs_number_prev(tixfs_image *img, const tixfs_prev *prev,
+        const tixfs_prev_file **match, const tixfs_prev_file **prev_if);
+
+/**
+ * Lays the files out after the tail of a previous image, leaving everything
+ * before it as it was. Files which are the same as in the previous image keep
+ * their old locations.
+ */
+static int tixfs_layout_append(tixfs_image *img, const tixfs_prev *prev);
+
+/**
+ * Appends the files in a subtree which changed, in post-order.
+ * @param buf Space for encoding a file (TIXFS_PAGE_SIZE bytes).
+ */
+static int tixfs_append_changed(tixfs_image *img, const tixfs_prev *prev,
+        int index, const tixfs_prev_file **match, uint8_t *buf);
+
+/**
+ * Checks whether an encoded file is already at a location in a previous
+ * image.
+ */
+static int tixfs_prev_equal(const tixfs_prev *prev, tix_far_ptr loc,
+        const uint8_t *data, int len);
+
+/**
+ * Places the files in a subtree which were not kept where they were, in
+ * post-order.
+ */
+static int tixfs_place_moved(tixfs_image *img, tixfs_space *space, int index,
+        const uint8_t *placed);
+
+/**
+ * Starts with every page from the head to the end page free.
+ * @return 0 on success, -1 if out of memory. tixfs_space_destroy() has to be
+ * called either way.
+ */
+static int tixfs_space_init(tixfs_space *space, const tixfs_image *img);
+static void tixfs_space_destroy(tixfs_space *space);
+
+/**
+ * Marks a range as used, if it is free.
+ * @return 0 on success, -1 if any of it is already used or outside of the
+ * filesystem.
+ */
+static int tixfs_space_reserve(tixfs_space *space, tixfs_image *img,
+        tix_far_ptr loc, int len);
+
+/**
+ * Finds the first free range large enough, starting from the head.
+ * @return 0 on success, TIXFS_ERR_FULL if there is none.
+ */
+static int tixfs_space_alloc(tixfs_space *space, tixfs_image *img,
+        int len, tix_far_ptr *loc);
+
+/**
+ * Finds the first free range large enough, starting from a given page.
+ * @return 0 on success, TIXFS_ERR_FULL if there is none.
+ */
+static int tixfs_space_alloc_from(tixfs_space *space, tixfs_image *img,
+        uint8_t from, int len, tix_far_ptr *loc);
+
+/**
+ * Gets the size of the largest free range in a page.
+ */
+static int tixfs_space_largest(const tixfs_space *space,
+        const tixfs_image *img, uint8_t page);
+
+/**
+ * Gets the path of each node, for matching them with a previous layout.
+ * @return Array of paths, or NULL if out of memory.
+ */
+static char **tixfs_node_paths(const tixfs_builder *b);
+
+static int tixfs_prev_file_cmp(const void *a, const void *b);
+
+/**
+ * Reads an inode and its data from an existing image.
+ * @return 0 on success, TIXFS_ERR_CORRUPT if it is not valid.
+ */
+static int tixfs_read_inode(tixfs_page_reader read_page, void *page_ctx,
+        tix_far_ptr loc, tixfs_inode *inode, const uint8_t **data);
+
+/**
+ * Visits a file and, if it is a directory, everything in it.
+ */
+static int tixfs_walk_file(tixfs_walker *w, uint16_t num, uint16_t parent);
+
+static int tixfs_prev_visit(void *ctx, const tixfs_entry *entry);
+
+/**
+ * Reads a 16-bit little-endian word.
+ */
+static uint16_t tixfs_get_word(const uint8_t *src);
+
+/**
+ * Reserves space for an inode and its data at the tail, moving to the next
+ * page if it would extend past the end of the current one.
+ * @return 0 on success, TIXFS_ERR_FULL if the filesystem is full.
+ */
+static int tixfs_alloc(tixfs_image *img, int size, tix_far_ptr *loc);
+
+static long tixfs_image_size(const tixfs_image *img);
+
+/**
+ * Encodes a file's inode and data.
+ * @return Pointer to the end of the data.
+ */
+static uint8_t *tixfs_put_node(const tixfs_image *img, int index,
+        uint8_t *dest);
+
+/**
+ * Encodes the inode file's inode and data.
+ * @return Pointer to the end of the data.
+ */
+static uint8_t *tixfs_put_inode_file(const tixfs_image *img, uint8_t *dest);
+
+static void tixfs_encode_into(const tixfs_image *img, uint8_t *data);
+
+const char *tixfs_strerror(int err) {
+    switch (err) {
+    case TIXFS_OK:
+        return "Success";
+    case TIXFS_ERR_NOMEM:
+        return "Out of memory";
+    case TIXFS_ERR_INVAL:
+        return "Invalid argument";
+    case TIXFS_ERR_FULL:
+        return "Filesystem full";
+    case TIXFS_ERR_TOO_BIG:
+        return "File too large";
+    case TIXFS_ERR_TOO_MANY:
+        return "Too many files";
+    case TIXFS_ERR_IO:
+        return "I/O error";
+    case TIXFS_ERR_CORRUPT:
+        return "Invalid image";
+    case TIXFS_ERR_NOENT:
+        return "No such file";
+    default:
+        return "Unknown error";
+    }
+}
+
+tixfs_builder *tixfs_builder_create(void) {
+    tixfs_builder *b = malloc(sizeof(*b));
+    if (!b) {
+        return NULL;
+    }
+
+    b->node_count = 0;
+    b->node_cap = 16;
+    b->nodes = malloc(b->node_cap * sizeof(b->nodes[0]));
+    if (!b->nodes) {
+        free(b);
+        return NULL;
+    }
+
+    b->chunks = NULL;
+
+    b->hot_len = 0;
+    b->hot_cap = 0;
+    b->hot = NULL;
+
+    return b;
+}
+
+void tixfs_builder_destroy(tixfs_builder *b) {
+    if (!b) {
+        return;
+    }
+
+    while (b->chunks) {
+        tixfs_chunk *next = b->chunks->next;
+        free(b->chunks);
+        b->chunks = next;
+    }
+
+    free(b->hot);
+    free(b->nodes);
+    free(b);
+}
+
+int tixfs_add_dir(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr) {
+    tixfs_inode inode;
+
+    if (!b || !attr) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    inode.mode = TIX_S_IFDIR | (attr->mode & 07777);
+    inode.size = 0;
+    inode.uid = attr->uid;
+    inode.gid = attr->gid;
+    inode.nlinks = 1;
+
+    return tixfs_add_node(b, parent, name, &inode);
+}
+
+int tixfs_add_file(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr, const void *data, size_t size) {
+    tixfs_inode inode;
+    uint8_t *copy;
+    int index;
+
+    if (!b || !attr || (!data && size > 0)) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    if (size > TIXFS_FILE_SIZE_MAX) {
+        return TIXFS_ERR_TOO_BIG;
+    }
+
+    /* Copy the data first so that a node is never left without it */
+    copy = tixfs_chunk_alloc(b, size);
+    if (!copy) {
+        return TIXFS_ERR_NOMEM;
+    }
+    memcpy(copy, data, size);
+
+    inode.mode = TIX_S_IFREG | (attr->mode & 07777);
+    inode.size = size;
+    inode.uid = attr->uid;
+    inode.gid = attr->gid;
+    inode.nlinks = 1;
+
+    index = tixfs_add_node(b, parent, name, &inode);
+    if (index < 0) {
+        tixfs_chunk_shrink(b, size);
+        return index;
+    }
+
+    b->nodes[index].data = copy;
+    return index;
+}
+
+int tixfs_add_file_fd(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr, int fd, size_t size) {
+    uint8_t *data;
+    size_t len = 0;
+    int index;
+
+    if (!b || !attr || fd < 0) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    if (size > TIXFS_FILE_SIZE_MAX) {
+        return TIXFS_ERR_TOO_BIG;
+    }
+
+    /* Read straight into the chunk, then give back what was not used */
+    data = tixfs_chunk_alloc(b, size);
+    if (!data) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    while (len < size) {
+        ssize_t ret = read(fd, &data[len], size - len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            tixfs_chunk_shrink(b, size);
+            return TIXFS_ERR_IO;
+        } else if (ret == 0) {
+            break;
+        }
+
+        len += ret;
+    }
+
+    tixfs_chunk_shrink(b, size - len);
+
+    tixfs_inode inode;
+    inode.mode = TIX_S_IFREG | (attr->mode & 07777);
+    inode.size = len;
+    inode.uid = attr->uid;
+    inode.gid = attr->gid;
+    inode.nlinks = 1;
+
+    index = tixfs_add_node(b, parent, name, &inode);
+    if (index < 0) {
+        /* Nothing else has been taken from the chunk since */
+        tixfs_chunk_shrink(b, len);
+        return index;
+    }
+
+    b->nodes[index].data = data;
+    return index;
+}
+
+int tixfs_add_device(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr, int block, uint8_t major, uint8_t minor) {
+    tixfs_inode inode;
+    uint8_t *data;
+    int index;
+
+    if (!b || !attr) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    inode.mode = (block ? TIX_S_IFBLK : TIX_S_IFCHR) | (attr->mode & 07777);
+    inode.size = 2;
+    inode.uid = attr->uid;
+    inode.gid = attr->gid;
+    inode.nlinks = 1;
+
+    data = tixfs_chunk_alloc(b, 2);
+    if (!data) {
+        return TIXFS_ERR_NOMEM;
+    }
+    data[0] = major;
+    data[1] = minor;
+
+    index = tixfs_add_node(b, parent, name, &inode);
+    if (index < 0) {
+        tixfs_chunk_shrink(b, 2);
+        return index;
+    }
+
+    b->nodes[index].data = data;
+    return index;
+}
+
+int tixfs_set_file(tixfs_builder *b, int node, const tixfs_attr *attr,
+        const void *data, size_t size) {
+    tixfs_node *n;
+    uint8_t *copy;
+
+    if (!b || !attr || (!data && size > 0) || node < 0
+            || node >= b->node_count) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    n = &b->nodes[node];
+    if ((n->inode.mode & TIX_S_IFMT) == TIX_S_IFDIR) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    if (size > TIXFS_FILE_SIZE_MAX) {
+        return TIXFS_ERR_TOO_BIG;
+    }
+
+    /* The old contents stay in their chunk until the builder is destroyed */
+    copy = tixfs_chunk_alloc(b, size);
+    if (!copy) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    memcpy(copy, data, size);
+    n->data = copy;
+    n->inode.mode = TIX_S_IFREG | (attr->mode & 07777);
+    n->inode.size = size;
+    n->inode.uid = attr->uid;
+    n->inode.gid = attr->gid;
+
+    return node;
+}
+
+int tixfs_builder_sort(tixfs_builder *b) {
+    int *children;
+    int cap = 16;
+
+    if (!b) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    children = malloc(cap * sizeof(children[0]));
+    if (!children) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    for (int i = 0; i < b->node_count; i++) {
+        tixfs_node *node = &b->nodes[i];
+        int count = 0;
+
+        for (int child = node->first_child; child >= 0;
+                child = b->nodes[child].next_sibling) {
+            if (count == cap) {
+                int *tmp = realloc(children, cap * 2 * sizeof(children[0]));
+                if (!tmp) {
+                    free(children);
+                    return TIXFS_ERR_NOMEM;
+                }
+
+                children = tmp;
+                cap *= 2;
+            }
+
+            children[count++] = child;
+        }
+
+        if (count < 2) {
+            continue;
+        }
+
+        /* A directory has at most 1023 entries, so a stable insertion sort
+         * is fast enough
+         */
+        for (int j = 1; j < count; j++) {
+            int child = children[j];
+            int k = j;
+
+            while (k > 0 && memcmp(b->nodes[children[k - 1]].name,
+                        b->nodes[child].name, TIXFS_NAME_MAX) > 0) {
+                children[k] = children[k - 1];
+                k--;
+            }
+            children[k] = child;
+        }
+
+        node->first_child = children[0];
+        for (int j = 0; j < count - 1; j++) {
+            b->nodes[children[j]].next_sibling = children[j + 1];
+        }
+        b->nodes[children[count - 1]].next_sibling = -1;
+        node->last_child = children[count - 1];
+    }
+
+    free(children);
+    return TIXFS_OK;
+}
+
+int tixfs_lookup(const tixfs_builder *b, const char *path) {
+    return tixfs_lookup_at(b, 0, path);
+}
+
+int tixfs_lookup_at(const tixfs_builder *b, int dir, const char *path) {
+    int index = dir;
+
+    if (!b || !path || dir < 0 || dir >= b->node_count) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    while (*path) {
+        const char *end;
+        int len;
+        int child;
+
+        while (*path == '/') {
+            path++;
+        }
+
+        end = strchr(path, '/');
+        len = end ? end - path : (int) strlen(path);
+        if (len == 0) {
+            break;
+        }
+
+        /* Names are cut off at TIXFS_NAME_MAX, like when they are added */
+        if (len > TIXFS_NAME_MAX) {
+            len = TIXFS_NAME_MAX;
+        }
+
+        for (child = b->nodes[index].first_child; child >= 0;
+                child = b->nodes[child].next_sibling) {
+            const char *name = b->nodes[child].name;
+
+            if (strncmp(name, path, len) == 0
+                    && (len == TIXFS_NAME_MAX || name[len] == 0)) {
+                break;
+            }
+        }
+
+        if (child < 0) {
+            return TIXFS_ERR_NOENT;
+        }
+
+        index = child;
+        path = end ? end : path + strlen(path);
+    }
+
+    return index;
+}
+
+int tixfs_mark_hot(tixfs_builder *b, int node) {
+    int depth = 0;
+
+    if (!b || node < 0 || node >= b->node_count) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    /* The directories leading to the file go first, starting at the root */
+    for (int i = node; !b->nodes[i].hot; i = b->nodes[i].parent) {
+        depth++;
+        if (i == 0) {
+            break;
+        }
+    }
+
+    if (depth == 0) {
+        return TIXFS_OK;
+    }
+
+    if (b->hot_len + depth > b->hot_cap) {
+        int cap = b->hot_cap ? b->hot_cap * 2 : 64;
+        while (cap < b->hot_len + depth) {
+            cap *= 2;
+        }
+
+        int *hot = realloc(b->hot, cap * sizeof(b->hot[0]));
+        if (!hot) {
+            return TIXFS_ERR_NOMEM;
+        }
+
+        b->hot = hot;
+        b->hot_cap = cap;
+    }
+
+    b->hot_len += depth;
+    for (int i = node, j = b->hot_len - 1; j >= b->hot_len - depth;
+            i = b->nodes[i].parent, j--) {
+        b->hot[j] = i;
+        b->nodes[i].hot = 1;
+    }
+
+    return TIXFS_OK;
+}
+
+long tixfs_node_size(const tixfs_builder *b, int node) {
+    if (!b || node < 0 || node >= b->node_count) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    return b->nodes[node].inode.size;
+}
+
+long tixfs_node_mode(const tixfs_builder *b, int node) {
+    if (!b || node < 0 || node >= b->node_count) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    return b->nodes[node].inode.mode;
+}
+
+void tixfs_target_init(tixfs_target *target) {
+    if (!target) {
+        return;
+    }
+
+    target->start_page = TIXFS_START_PAGE;
+    target->end_page = TIXFS_END_PAGE;
+    target->prev = NULL;
+    target->layout = TIXFS_LAYOUT_SEQ;
+    target->append = 0;
+}
+
+int tixfs_layout(const tixfs_builder *b, const tixfs_target *target,
+        tixfs_image **img_ptr) {
+    tixfs_image *img;
+    int ret;
+
+    if (!b || !target || !img_ptr || b->node_count == 0
+            || target->end_page < target->start_page + 4) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    img = malloc(sizeof(*img));
+    if (!img) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    img->builder = b;
+    img->start_page = target->start_page;
+    img->end_page = target->end_page;
+
+    /* 1 block (4 pages) is reserved as the anchor block */
+    img->head = (tix_far_ptr) {target->start_page + 4, TIXFS_REL_ADDR};
+    img->tail = img->head;
+
+    img->payload_bytes = 0;
+    img->padding_bytes = 0;
+    img->base = NULL;
+    img->data = NULL;
+
+    img->inode_nums = malloc(b->node_count * sizeof(img->inode_nums[0]));
+    img->inodes = malloc((b->node_count + 1) * sizeof(img->inodes[0]));
+    if (!img->inode_nums || !img->inodes) {
+        tixfs_image_destroy(img);
+        return TIXFS_ERR_NOMEM;
+    }
+
+    /* Inode 0 is the inode file */
+    img->inode_count = b->node_count + 1;
+    if (b->node_count * TIXFS_SIZEOF_INODE_ENTRY
+            > (int) TIXFS_FILE_SIZE_MAX) {
+        tixfs_image_destroy(img);
+        return TIXFS_ERR_TOO_MANY;
+    }
+
+    if (target->prev && target->append) {
+        ret = tixfs_layout_append(img, target->prev);
+    } else if (target->prev) {
+        ret = tixfs_layout_prev(img, target->prev);
+    } else if (target->layout == TIXFS_LAYOUT_CLUSTER) {
+        ret = tixfs_layout_cluster(img);
+    } else {
+        ret = tixfs_layout_seq(img);
+    }
+
+    if (ret < 0) {
+        tixfs_image_destroy(img);
+        return ret;
+    }
+
+    /* The rest of the block containing the tail is written with 0xFF */
+    img->last_page = img->tail.page | 3;
+
+    img->padding_bytes = (long) (img->last_page - img->head.page + 1)
+        * TIXFS_PAGE_SIZE - img->payload_bytes;
+
+    *img_ptr = img;
+    return TIXFS_OK;
+}
+
+int tixfs_encode(tixfs_image *img) {
+    if (!img || !img->builder) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    img->data = malloc(tixfs_image_size(img));
+    if (!img->data) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    tixfs_encode_into(img, img->data);
+    img->builder = NULL;
+    img->base = NULL;
+
+    return TIXFS_OK;
+}
+
+void tixfs_image_destroy(tixfs_image *img) {
+    if (!img) {
+        return;
+    }
+
+    free(img->inode_nums);
+    free(img->inodes);
+    free(img->data);
+    free(img);
+}
+
+void tixfs_image_info(const tixfs_image *img, tixfs_info *info) {
+    if (!img || !info) {
+        return;
+    }
+
+    info->start_page = img->start_page;
+    info->end_page = img->end_page;
+    info->head_page = img->head.page;
+    info->last_page = img->last_page;
+    info->tail = img->tail;
+    info->inode_file = img->inodes[0];
+    info->inode_count = img->inode_count;
+    info->payload_bytes = img->payload_bytes;
+    info->padding_bytes = img->padding_bytes;
+}
+
+const uint8_t *tixfs_image_data(const tixfs_image *img, size_t *size) {
+    if (!img || !img->data) {
+        return NULL;
+    }
+
+    if (size) {
+        *size = tixfs_image_size(img);
+    }
+
+    return img->data;
+}
+
+int tixfs_image_emit(const tixfs_image *img, tixfs_sink sink, void *ctx) {
+    int ret;
+
+    if (!img || !img->data || !sink) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    for (int page = img->head.page; page <= img->last_page; page++) {
+        ret = sink(ctx, page,
+                &img->data[(long) (page - img->start_page) * TIXFS_PAGE_SIZE]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* The anchor block goes last */
+    for (int page = img->start_page; page < img->start_page + 4; page++) {
+        ret = sink(ctx, page,
+                &img->data[(long) (page - img->start_page) * TIXFS_PAGE_SIZE]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return TIXFS_OK;
+}
+
+long tixfs_build(const tixfs_builder *b, const tixfs_target *target,
+        void *buf, size_t size) {
+    tixfs_image *img;
+    long img_size;
+    int ret;
+
+    if (!buf) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    if ((ret = tixfs_layout(b, target, &img)) < 0) {
+        return ret;
+    }
+
+    img_size = tixfs_image_size(img);
+    if ((size_t) img_size > size) {
+        tixfs_image_destroy(img);
+        return TIXFS_ERR_TOO_BIG;
+    }
+
+    /* Encode directly into the caller's buffer */
+    tixfs_encode_into(img, buf);
+    tixfs_image_destroy(img);
+
+    return img_size;
+}
+
+int tixfs_build_sink(const tixfs_builder *b, const tixfs_target *target,
+        tixfs_sink sink, void *ctx) {
+    tixfs_image *img;
+    int ret;
+
+    if ((ret = tixfs_layout(b, target, &img)) < 0) {
+        return ret;
+    }
+
+    if ((ret = tixfs_encode(img)) == 0) {
+        ret = tixfs_image_emit(img, sink, ctx);
+    }
+
+    tixfs_image_destroy(img);
+    return ret;
+}
+
+const uint8_t *tixfs_image_page(void *img_ptr, uint8_t page) {
+    const tixfs_image *img = img_ptr;
+
+    if (!img || !img->data || page < img->start_page
+            || page > img->last_page) {
+        return NULL;
+    }
+
+    return &img->data[(long) (page - img->start_page) * TIXFS_PAGE_SIZE];
+}
+
+int tixfs_walk(tixfs_page_reader read_page, void *page_ctx,
+        uint8_t start_page, tixfs_visitor visit, void *ctx) {
+    const uint8_t *anchor;
+    const uint8_t *data;
+    tixfs_walker w;
+    tixfs_entry entry;
+    tix_far_ptr loc;
+    int count;
+    int ret;
+
+    if (!read_page || !visit) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    /* The inode file location is at the end of the anchor block */
+    anchor = read_page(page_ctx, start_page + 3);
+    if (!anchor) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    loc.page = anchor[TIXFS_PAGE_SIZE - 4];
+    loc.addr = tixfs_get_word(&anchor[TIXFS_PAGE_SIZE - 3]);
+
+    entry.path = NULL;
+    entry.parent = 0;
+    entry.inode_num = 0;
+    entry.loc = loc;
+    if (tixfs_read_inode(read_page, page_ctx, loc, &entry.inode, &data) < 0
+            || entry.inode.mode != TIX_S_INDFIL) {
+        return TIXFS_ERR_CORRUPT;
+    }
+    entry.data = data;
+
+    w.read_page = read_page;
+    w.page_ctx = page_ctx;
+    w.visit = visit;
+    w.ctx = ctx;
+
+    /* Inode numbers are stored in the entries, so they do not have to be in
+     * order
+     */
+    count = entry.inode.size / TIXFS_SIZEOF_INODE_ENTRY;
+    w.inode_cap = 1;
+    for (int i = 0; i < count; i++) {
+        uint16_t num = tixfs_get_word(&data[i * TIXFS_SIZEOF_INODE_ENTRY]);
+        if (num >= w.inode_cap) {
+            w.inode_cap = num + 1;
+        }
+    }
+
+    w.locs = malloc(w.inode_cap * sizeof(w.locs[0]));
+    w.valid = calloc(w.inode_cap, 1);
+    w.entered = calloc(w.inode_cap, 1);
+    w.path_cap = 64;
+    w.path = malloc(w.path_cap);
+    if (!w.locs || !w.valid || !w.entered || !w.path) {
+        ret = TIXFS_ERR_NOMEM;
+        goto done;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const uint8_t *src = &data[i * TIXFS_SIZEOF_INODE_ENTRY];
+        uint16_t num = tixfs_get_word(src);
+
+        w.locs[num].page = src[2];
+        w.locs[num].addr = tixfs_get_word(&src[3]);
+        w.valid[num] = 1;
+    }
+
+    if ((ret = visit(ctx, &entry)) < 0) {
+        goto done;
+    }
+
+    strcpy(w.path, "/");
+    w.path_len = 1;
+    ret = tixfs_walk_file(&w, 1, 0);
+
+done:
+    free(w.locs);
+    free(w.valid);
+    free(w.entered);
+    free(w.path);
+    return ret;
+}
+
+tixfs_prev *tixfs_prev_create(void) {
+    tixfs_prev *prev = malloc(sizeof(*prev));
+    if (!prev) {
+        return NULL;
+    }
+
+    prev->len = 0;
+    prev->cap = 0;
+    prev->files = NULL;
+    prev->pages = NULL;
+    return prev;
+}
+
+void tixfs_prev_destroy(tixfs_prev *prev) {
+    if (!prev) {
+        return;
+    }
+
+    for (int i = 0; i < prev->len; i++) {
+        free(prev->files[i].path);
+    }
+
+    free(prev->files);
+    free(prev->pages);
+    free(prev);
+}
+
+int tixfs_prev_add(tixfs_prev *prev, const char *path, uint16_t inode_num,
+        tix_far_ptr loc, uint16_t size) {
+    tixfs_prev_file *file;
+
+    if (!prev) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    if (prev->len == prev->cap) {
+        int cap = prev->cap ? prev->cap * 2 : 64;
+        tixfs_prev_file *files = realloc(prev->files,
+                cap * sizeof(prev->files[0]));
+        if (!files) {
+            return TIXFS_ERR_NOMEM;
+        }
+
+        prev->files = files;
+        prev->cap = cap;
+    }
+
+    file = &prev->files[prev->len];
+    file->path = NULL;
+    if (path && !(file->path = strdup(path))) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    file->inode_num = inode_num;
+    file->loc = loc;
+    file->size = size;
+    prev->len++;
+
+    return TIXFS_OK;
+}
+
+int tixfs_prev_load(tixfs_prev *prev, tixfs_page_reader read_page,
+        void *page_ctx, uint8_t start_page) {
+    int ret;
+
+    if (!prev || prev->pages) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    prev->start_page = start_page;
+    prev->tail = (tix_far_ptr) {start_page + 4, TIXFS_REL_ADDR};
+
+    ret = tixfs_walk(read_page, page_ctx, start_page, tixfs_prev_visit, prev);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Keep the pages up to the tail, so that the image can be appended to */
+    prev->last_page = prev->tail.page | 3;
+    prev->pages = malloc((long) (prev->last_page - start_page + 1)
+            * TIXFS_PAGE_SIZE);
+    if (!prev->pages) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    for (int page = start_page; page <= prev->last_page; page++) {
+        const uint8_t *src = read_page(page_ctx, page);
+        uint8_t *dest = &prev->pages[(long) (page - start_page)
+            * TIXFS_PAGE_SIZE];
+
+        if (src) {
+            memcpy(dest, src, TIXFS_PAGE_SIZE);
+        } else {
+            memset(dest, 0xFF, TIXFS_PAGE_SIZE);
+        }
+    }
+
+    return TIXFS_OK;
+}
+
+static uint8_t *tixfs_chunk_alloc(tixfs_builder *b, size_t size) {
+    tixfs_chunk *chunk = b->chunks;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > TIXFS_CHUNK_SIZE ? size : TIXFS_CHUNK_SIZE;
+
+        chunk = malloc(sizeof(*chunk) + chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = b->chunks;
+        b->chunks = chunk;
+    }
+
+    chunk->used += size;
+    return &chunk->data[chunk->used - size];
+}
+
+static void tixfs_chunk_shrink(tixfs_builder *b, size_t unused) {
+    b->chunks->used -= unused;
+}
+
+static int tixfs_add_node(tixfs_builder *b, int parent, const char *name,
+        const tixfs_inode *inode) {
+    tixfs_node *node;
+    tixfs_node *pnode = NULL;
+    int is_dir = (inode->mode & TIX_S_IFMT) == TIX_S_IFDIR;
+    int index;
+    size_t name_len;
+
+    if (!b || !name) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    name_len = strnlen(name, TIXFS_NAME_MAX);
+
+    /* The first node has to be the root directory, and there is only one */
+    if (parent == TIXFS_NO_PARENT) {
+        if (b->node_count > 0 || !is_dir) {
+            return TIXFS_ERR_INVAL;
+        }
+    } else {
+        if (parent < 0 || parent >= b->node_count || strchr(name, '/')
+                || (b->nodes[parent].inode.mode & TIX_S_IFMT) != TIX_S_IFDIR) {
+            return TIXFS_ERR_INVAL;
+        }
+
+        pnode = &b->nodes[parent];
+        if (pnode->inode.size + TIXFS_SIZEOF_DIR_ENTRY
+                > (int) TIXFS_FILE_SIZE_MAX) {
+            return TIXFS_ERR_TOO_MANY;
+        }
+    }
+
+    if (b->node_count >= b->node_cap) {
+        tixfs_node *nodes = realloc(b->nodes,
+                b->node_cap * 2 * sizeof(b->nodes[0]));
+        if (!nodes) {
+            return TIXFS_ERR_NOMEM;
+        }
+
+        b->nodes = nodes;
+        b->node_cap *= 2;
+        if (pnode) {
+            pnode = &b->nodes[parent];
+        }
+    }
+
+    index = b->node_count++;
+    node = &b->nodes[index];
+
+    node->inode = *inode;
+    /* Names are padded with 0, and only NUL-terminated if shorter */
+    memset(node->name, 0, TIXFS_NAME_MAX);
+    memcpy(node->name, name, name_len);
+    node->first_child = -1;
+    node->last_child = -1;
+    node->next_sibling = -1;
+    node->data = NULL;
+    node->hot = 0;
+
+    if (is_dir) {
+        /* Only the ".." entry for now. The directory is linked to by its
+         * parent, and the root is also linked to by its own ".." entry.
+         */
+        node->inode.size = TIXFS_SIZEOF_DIR_ENTRY;
+        node->inode.nlinks = pnode ? 1 : 2;
+    }
+
+    if (!pnode) {
+        node->parent = index;
+        return index;
+    }
+
+    node->parent = parent;
+
+    if (pnode->last_child < 0) {
+        pnode->first_child = index;
+    } else {
+        b->nodes[pnode->last_child].next_sibling = index;
+    }
+    pnode->last_child = index;
+    pnode->inode.size += TIXFS_SIZEOF_DIR_ENTRY;
+
+    /* Add a link to the parent from the ".." entry */
+    if (is_dir) {
+        pnode->inode.nlinks++;
+    }
+
+    return index;
+}
+
+/**
+ * Numbers the inodes in a subtree in pre-order, so that the root is inode 1.
+ */
+static void tixfs_number_inodes(tixfs_image *img, int index) {
+    const tixfs_builder *b = img->builder;
+
+    img->inode_nums[index] = img->inode_count++;
+
+    for (int child = b->nodes[index].first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        tixfs_number_inodes(img, child);
+    }
+}
+
+/**
+ * Places the files in a subtree in post-order, since the size of a directory
+ * is only known after its entries are added.
+ */
+static int tixfs_place_files(tixfs_image *img, int index) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_node *node = &b->nodes[index];
+    int ret;
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        if ((ret = tixfs_place_files(img, child)) < 0) {
+            return ret;
+        }
+    }
+
+    /* Hot files are already placed */
+    if (node->hot) {
+        return TIXFS_OK;
+    }
+
+    return tixfs_alloc(img, node->inode.size,
+            &img->inodes[img->inode_nums[index]]);
+}
+
+static int tixfs_layout_seq(tixfs_image *img) {
+    const tixfs_builder *b = img->builder;
+    int if_size;
+    int ret;
+
+    img->inode_count = 1;
+    tixfs_number_inodes(img, 0);
+    if_size = (img->inode_count - 1) * TIXFS_SIZEOF_INODE_ENTRY;
+
+    if (b->hot_len == 0) {
+        /* The inode file goes after everything else */
+        if ((ret = tixfs_place_files(img, 0)) < 0) {
+            return ret;
+        }
+
+        return tixfs_alloc(img, if_size, &img->inodes[0]);
+    }
+
+    /* The inode file goes first, followed by the hot files in the order they
+     * are used, so that they share as few pages as possible
+     */
+    if ((ret = tixfs_alloc(img, if_size, &img->inodes[0])) < 0) {
+        return ret;
+    }
+
+    for (int i = 0; i < b->hot_len; i++) {
+        int index = b->hot[i];
+
+        if ((ret = tixfs_alloc(img, b->nodes[index].inode.size,
+                        &img->inodes[img->inode_nums[index]])) < 0) {
+            return ret;
+        }
+    }
+
+    return tixfs_place_files(img, 0);
+}
+
+static int tixfs_layout_cluster(tixfs_image *img) {
+    const tixfs_builder *b = img->builder;
+    tixfs_space space;
+    int *overflow;
+    int overflow_len = 0;
+    int ret;
+
+    overflow = malloc(b->node_count * sizeof(overflow[0]));
+    if (!overflow) {
+        return TIXFS_ERR_NOMEM;
+    }
+
+    if (tixfs_space_init(&space, img) < 0) {
+        free(overflow);
+        tixfs_space_destroy(&space);
+        return TIXFS_ERR_NOMEM;
+    }
+
+    img->inode_count = 1;
+    tixfs_number_cluster(img, 0);
+
+    /* The inode file is read for every file on a path, so it goes first, where
+     * the root can share its page. Hot files go after it, as with the
+     * sequential layout.
+     */
+    if ((ret = tixfs_space_alloc(&space, img, TIXFS_SIZEOF_INODE
+                    + (img->inode_count - 1) * TIXFS_SIZEOF_INODE_ENTRY,
+                    &img->inodes[0])) < 0) {
+        goto done;
+    }
+
+    for (int i = 0; i < b->hot_len; i++) {
+        int index = b->hot[i];
+
+        if ((ret = tixfs_space_alloc(&space, img,
+                        TIXFS_SIZEOF_INODE + b->nodes[index].inode.size,
+                        &img->inodes[img->inode_nums[index]])) < 0) {
+            goto done;
+        }
+    }
+
+    if ((ret = tixfs_place_cluster(img, &space, 0, img->inodes[0].page,
+                    overflow, &overflow_len)) < 0) {
+        goto done;
+    }
+
+    /* Files too large to go with their directory are on a page of their own
+     * anyway, so they fill in whatever space is left
+     */
+    for (int i = 0; i < overflow_len; i++) {
+        int index = overflow[i];
+
+        if ((ret = tixfs_space_alloc(&space, img,
+                        TIXFS_SIZEOF_INODE + b->nodes[index].inode.size,
+                        &img->inodes[img->inode_nums[index]])) < 0) {
+            goto done;
+        }
+    }
+
+done:
+    free(overflow);
+    tixfs_space_destroy(&space);
+    return ret;
+}
+
+static void tixfs_number_cluster(tixfs_image *img, int index) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_node *node = &b->nodes[index];
+
+    if (index == 0) {
+        img->inode_nums[index] = img->inode_count++;
+    }
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        if (!tixfs_is_dir(&b->nodes[child])) {
+            img->inode_nums[child] = img->inode_count++;
+        }
+    }
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        if (tixfs_is_dir(&b->nodes[child])) {
+            img->inode_nums[child] = img->inode_count++;
+            tixfs_number_cluster(img, child);
+        }
+    }
+}
+
+static int tixfs_is_dir(const tixfs_node *node) {
+    return (node->inode.mode & TIX_S_IFMT) == TIX_S_IFDIR;
+}
+
+static int tixfs_place_cluster(tixfs_image *img, tixfs_space *space,
+        int index, uint8_t from, int *overflow, int *overflow_len) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_node *node = &b->nodes[index];
+    tix_far_ptr loc = {from, TIXFS_REL_ADDR};
+    int room = TIXFS_PAGE_SIZE;
+    int len = 0;
+    int ret;
+
+    /* Stay on the parent's page if the directory fits there, even if fewer of
+     * its files do, since every path through the directory is on that page
+     * too
+     */
+    if (!node->hot) {
+        int free_len = tixfs_space_largest(space, img, from);
+
+        len = TIXFS_SIZEOF_INODE + node->inode.size;
+        if (free_len >= len) {
+            room = free_len;
+        }
+    }
+
+    /* Find how much of the directory and its files fit. Large files are
+     * skipped rather than stopping there, so that the smaller ones after them
+     * still go with the directory.
+     */
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        const tixfs_node *c = &b->nodes[child];
+        int c_len = TIXFS_SIZEOF_INODE + c->inode.size;
+
+        if (c->hot || tixfs_is_dir(c)) {
+            continue;
+        }
+
+        if (len + c_len <= room) {
+            len += c_len;
+        } else {
+            overflow[(*overflow_len)++] = child;
+        }
+    }
+
+    if (len > 0 && (ret = tixfs_space_alloc_from(space, img, from, len,
+                    &loc)) < 0) {
+        return ret;
+    }
+
+    /* Go through the files again in the same order to put them in the space
+     * just allocated
+     */
+    len = 0;
+    if (!node->hot) {
+        img->inodes[img->inode_nums[index]] = loc;
+        len = TIXFS_SIZEOF_INODE + node->inode.size;
+    }
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        const tixfs_node *c = &b->nodes[child];
+        int c_len = TIXFS_SIZEOF_INODE + c->inode.size;
+
+        if (!c->hot && !tixfs_is_dir(c) && len + c_len <= room) {
+            img->inodes[img->inode_nums[child]] =
+                (tix_far_ptr) {loc.page, loc.addr + len};
+            len += c_len;
+        }
+    }
+
+    /* Subdirectories go on the same page if there is room, or as close after
+     * it as possible
+     */
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        if (tixfs_is_dir(&b->nodes[child])
+                && (ret = tixfs_place_cluster(img, space, child, loc.page,
+                        overflow, overflow_len)) < 0) {
+            return ret;
+        }
+    }
+
+    return TIXFS_OK;
+}
+
+static int tixfs_layout_prev(tixfs_image *img, const tixfs_prev *prev) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_prev_file **match = NULL;
+    const tixfs_prev_file *prev_if = NULL;
+    uint8_t *placed = NULL;
+    tixfs_space space;
+    int if_size = b->node_count * TIXFS_SIZEOF_INODE_ENTRY;
+    int ret = TIXFS_ERR_NOMEM;
+
+    if (tixfs_space_init(&space, img) < 0) {
+        tixfs_space_destroy(&space);
+        return TIXFS_ERR_NOMEM;
+    }
+
+    match = calloc(b->node_count, sizeof(match[0]));
+    placed = calloc(b->node_count, 1);
+    if (!match || !placed
+            || (ret = tixfs_number_prev(img, prev, match, &prev_if)) < 0) {
+        goto done;
+    }
+
+    /* Files which still fit where they were stay there */
+    for (int i = 0; i < b->node_count; i++) {
+        int size = b->nodes[i].inode.size;
+
+        if (match[i] && size <= match[i]->size
+                && tixfs_space_reserve(&space, img, match[i]->loc,
+                    TIXFS_SIZEOF_INODE + size) == 0) {
+            img->inodes[img->inode_nums[i]] = match[i]->loc;
+            placed[i] = 1;
+        }
+    }
+
+    int if_placed = prev_if && if_size <= prev_if->size
+        && tixfs_space_reserve(&space, img, prev_if->loc,
+                TIXFS_SIZEOF_INODE + if_size) == 0;
+    if (if_placed) {
+        img->inodes[0] = prev_if->loc;
+    }
+
+    /* Everything else goes in the gaps or after the old tail */
+    if ((ret = tixfs_place_moved(img, &space, 0, placed)) < 0) {
+        goto done;
+    }
+
+    if (!if_placed) {
+        ret = tixfs_space_alloc(&space, img, TIXFS_SIZEOF_INODE + if_size,
+                &img->inodes[0]);
+    }
+
+done:
+    free(match);
+    free(placed);
+    tixfs_space_destroy(&space);
+    return ret;
+}
+
+static int tixfs_number_prev(tixfs_image *img, const tixfs_prev *prev,
+        const tixfs_prev_file **match, const tixfs_prev_file **prev_if) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_prev_file **sorted = NULL;
+    char **paths = NULL;
+    uint8_t *used = NULL;
+    int sorted_len = 0;
+    int next_num = 2;
+    int ret = TIXFS_ERR_NOMEM;
+
+    sorted = malloc((prev->len + 1) * sizeof(sorted[0]));
+    used = calloc(b->node_count + 2, 1);
+    paths = tixfs_node_paths(b);
+    if (!sorted || !used || !paths) {
+        goto done;
+    }
+
+    *prev_if = NULL;
+    for (int i = 0; i < prev->len; i++) {
+        if (prev->files[i].path) {
+            sorted[sorted_len++] = &prev->files[i];
+        } else {
+            *prev_if = &prev->files[i];
+        }
+    }
+    qsort(sorted, sorted_len, sizeof(sorted[0]), tixfs_prev_file_cmp);
+
+    /* Files keep their old inode numbers, as long as they are still in range
+     * and not taken by another link to the same inode. The root is always 1.
+     */
+    for (int i = 0; i < b->node_count; i++) {
+        tixfs_prev_file key = {paths[i], 0, {0, 0}, 0};
+        const tixfs_prev_file *keyp = &key;
+        const tixfs_prev_file **found = bsearch(&keyp, sorted, sorted_len,
+                sizeof(sorted[0]), tixfs_prev_file_cmp);
+        int num;
+
+        img->inode_nums[i] = 0;
+        match[i] = NULL;
+        if (!found) {
+            continue;
+        }
+
+        match[i] = *found;
+        num = match[i]->inode_num;
+        if (i == 0) {
+            img->inode_nums[i] = 1;
+        } else if (num >= 2 && num <= b->node_count && !used[num]) {
+            img->inode_nums[i] = num;
+        }
+        used[img->inode_nums[i]] = 1;
+    }
+
+    /* Everything else fills in the unused numbers, so that the inode file has
+     * no holes
+     */
+    img->inode_nums[0] = 1;
+    for (int i = 1; i < b->node_count; i++) {
+        if (img->inode_nums[i] != 0) {
+            continue;
+        }
+
+        while (used[next_num]) {
+            next_num++;
+        }
+        img->inode_nums[i] = next_num;
+        used[next_num] = 1;
+    }
+
+    ret = TIXFS_OK;
+
+done:
+    if (paths) {
+        for (int i = 0; i < b->node_count; i++) {
+            free(paths[i]);
+        }
+    }
+    free(paths);
+    free(sorted);
+    free(used);
+    return ret;
+}
+
+static int tixfs_layout_append(tixfs_image *img, const tixfs_prev *prev) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_prev_file **match = NULL;
+    const tixfs_prev_file *prev_if = NULL;
+    uint8_t *buf = NULL;
+    int ret = TIXFS_ERR_NOMEM;
+
+    if (!prev->pages || prev->start_page != img->start_page
+            || prev->last_page > img->end_page) {
+        return TIXFS_ERR_INVAL;
+    }
+
+    match = calloc(b->node_count, sizeof(match[0]));
+    buf = malloc(TIXFS_PAGE_SIZE);
+    if (!match || !buf
+            || (ret = tixfs_number_prev(img, prev, match, &prev_if)) < 0) {
+        goto done;
+    }
+
+    /* Everything up to the old tail stays where it is, even the files which
+     * are no longer used, since the pages are not erased
+     */
+    img->base = prev;
+    img->tail = prev->tail;
+    img->payload_bytes = (long) (prev->tail.page - img->head.page)
+        * TIXFS_PAGE_SIZE + (prev->tail.addr - TIXFS_REL_ADDR);
+
+    if ((ret = tixfs_append_changed(img, prev, 0, match, buf)) < 0) {
+        goto done;
+    }
+
+    /* The inode file only has to be written again if an inode moved */
+    int if_len = tixfs_put_inode_file(img, buf) - buf;
+    if (prev_if && tixfs_prev_equal(prev, prev_if->loc, buf, if_len)) {
+        img->inodes[0] = prev_if->loc;
+    } else {
+        ret = tixfs_alloc(img, if_len - TIXFS_SIZEOF_INODE, &img->inodes[0]);
+    }
+
+done:
+    free(match);
+    free(buf);
+    return ret;
+}
+
+static int tixfs_append_changed(tixfs_image *img, const tixfs_prev *prev,
+        int index, const tixfs_prev_file **match, uint8_t *buf) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_node *node = &b->nodes[index];
+    tix_far_ptr *loc = &img->inodes[img->inode_nums[index]];
+    int len;
+    int ret;
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        if ((ret = tixfs_append_changed(img, prev, child, match, buf)) < 0) {
+            return ret;
+        }
+    }
+
+    /* Directories depend on the inode numbers of their entries, which are
+     * already known, so they can be compared like any other file
+     */
+    len = tixfs_put_node(img, index, buf) - buf;
+    if (match[index] && tixfs_prev_equal(prev, match[index]->loc, buf, len)) {
+        *loc = match[index]->loc;
+        return TIXFS_OK;
+    }
+
+    return tixfs_alloc(img, node->inode.size, loc);
+}
+
+static int tixfs_prev_equal(const tixfs_prev *prev, tix_far_ptr loc,
+        const uint8_t *data, int len) {
+    int offset = loc.addr - TIXFS_REL_ADDR;
+
+    if (loc.page < prev->start_page + 4 || loc.page > prev->last_page
+            || loc.addr < TIXFS_REL_ADDR || offset + len > TIXFS_PAGE_SIZE) {
+        return 0;
+    }
+
+    return memcmp(&prev->pages[(long) (loc.page - prev->start_page)
+            * TIXFS_PAGE_SIZE + offset], data, len) == 0;
+}
+
+static int tixfs_place_moved(tixfs_image *img, tixfs_space *space, int index,
+        const uint8_t *placed) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_node *node = &b->nodes[index];
+    int ret;
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        if ((ret = tixfs_place_moved(img, space, child, placed)) < 0) {
+            return ret;
+        }
+    }
+
+    if (placed[index]) {
+        return TIXFS_OK;
+    }
+
+    return tixfs_space_alloc(space, img, TIXFS_SIZEOF_INODE + node->inode.size,
+            &img->inodes[img->inode_nums[index]]);
+}
+
+static int tixfs_space_init(tixfs_space *space, const tixfs_image *img) {
+    space->page_count = img->end_page - img->head.page + 1;
+    space->pages = calloc(space->page_count, sizeof(space->pages[0]));
+    if (!space->pages) {
+        return -1;
+    }
+
+    /* Every page starts out completely free */
+    for (int i = 0; i < space->page_count; i++) {
+        space->pages[i].extents = malloc(4 * sizeof(tixfs_extent));
+        if (!space->pages[i].extents) {
+            return -1;
+        }
+
+        space->pages[i].len = 1;
+        space->pages[i].cap = 4;
+        space->pages[i].extents[0] = (tixfs_extent) {0, TIXFS_PAGE_SIZE};
+    }
+
+    return 0;
+}
+
+static void tixfs_space_destroy(tixfs_space *space) {
+    if (!space->pages) {
+        return;
+    }
+
+    for (int i = 0; i < space->page_count; i++) {
+        free(space->pages[i].extents);
+    }
+
+    free(space->pages);
+}
+
+static int tixfs_space_reserve(tixfs_space *space, tixfs_image *img,
+        tix_far_ptr loc, int len) {
+    int page = loc.page - img->head.page;
+    int start = loc.addr - TIXFS_REL_ADDR;
+    int end = start + len;
+
+    if (page < 0 || page >= space->page_count
+            || loc.addr < TIXFS_REL_ADDR || end > TIXFS_PAGE_SIZE) {
+        return -1;
+    }
+
+    int *ext_len = &space->pages[page].len;
+    tixfs_extent *extents = space->pages[page].extents;
+    int i;
+
+    for (i = 0; i < *ext_len; i++) {
+        if (extents[i].start <= start && end <= extents[i].end) {
+            break;
+        }
+    }
+
+    if (i == *ext_len) {
+        return -1;
+    }
+
+    if (extents[i].start < start && end < extents[i].end) {
+        /* Split the extent in two */
+        if (*ext_len == space->pages[page].cap) {
+            int cap = space->pages[page].cap * 2;
+            extents = realloc(extents, cap * sizeof(extents[0]));
+            if (!extents) {
+                return -1;
+            }
+
+            space->pages[page].extents = extents;
+            space->pages[page].cap = cap;
+        }
+
+        memmove(&extents[i + 2], &extents[i + 1],
+                (*ext_len - i - 1) * sizeof(extents[0]));
+        extents[i + 1] = (tixfs_extent) {end, extents[i].end};
+        extents[i].end = start;
+        (*ext_len)++;
+    } else if (extents[i].start < start) {
+        extents[i].end = start;
+    } else if (end < extents[i].end) {
+        extents[i].start = end;
+    } else {
+        memmove(&extents[i], &extents[i + 1],
+                (*ext_len - i - 1) * sizeof(extents[0]));
+        (*ext_len)--;
+    }
+
+    /* The tail is the end of the last file */
+    if (loc.page > img->tail.page
+            || (loc.page == img->tail.page
+                && loc.addr + len > img->tail.addr)) {
+        img->tail = (tix_far_ptr) {loc.page, loc.addr + len};
+    }
+
+    img->payload_bytes += len;
+    return 0;
+}
+
+static int tixfs_space_alloc(tixfs_space *space, tixfs_image *img,
+        int len, tix_far_ptr *loc) {
+    return tixfs_space_alloc_from(space, img, img->head.page, len, loc);
+}
+
+static int tixfs_space_alloc_from(tixfs_space *space, tixfs_image *img,
+        uint8_t from, int len, tix_far_ptr *loc) {
+    for (int page = from - img->head.page; page < space->page_count;
+            page++) {
+        const tixfs_extent *extents = space->pages[page].extents;
+
+        for (int i = 0; i < space->pages[page].len; i++) {
+            if (extents[i].end - extents[i].start >= len) {
+                *loc = (tix_far_ptr) {img->head.page + page,
+                    TIXFS_REL_ADDR + extents[i].start};
+                return tixfs_space_reserve(space, img, *loc, len) < 0
+                    ? TIXFS_ERR_NOMEM : TIXFS_OK;
+            }
+        }
+    }
+
+    return TIXFS_ERR_FULL;
+}
+
+static int tixfs_space_largest(const tixfs_space *space,
+        const tixfs_image *img, uint8_t page) {
+    int i = page - img->head.page;
+    int largest = 0;
+
+    for (int j = 0; j < space->pages[i].len; j++) {
+        const tixfs_extent *extent = &space->pages[i].extents[j];
+
+        if (extent->end - extent->start > largest) {
+            largest = extent->end - extent->start;
+        }
+    }
+
+    return largest;
+}
+
+static char **tixfs_node_paths(const tixfs_builder *b) {
+    char **paths = calloc(b->node_count, sizeof(paths[0]));
+    if (!paths) {
+        return NULL;
+    }
+
+    /* Parents are always added before their entries */
+    for (int i = 0; i < b->node_count; i++) {
+        const tixfs_node *node = &b->nodes[i];
+        const char *parent = paths[node->parent];
+        int name_len = strnlen(node->name, TIXFS_NAME_MAX);
+        int parent_len;
+
+        if (i == 0) {
+            paths[i] = strdup("/");
+        } else {
+            parent_len = strlen(parent);
+            paths[i] = malloc(parent_len + 1 + name_len + 1);
+            if (paths[i]) {
+                /* The root already ends in a '/' */
+                sprintf(paths[i], "%s%s%.*s", parent,
+                        parent_len > 1 ? "/" : "", name_len, node->name);
+            }
+        }
+
+        if (!paths[i]) {
+            for (int j = 0; j < i; j++) {
+                free(paths[j]);
+            }
+            free(paths);
+            return NULL;
+        }
+    }
+
+    return paths;
+}
+
+static int tixfs_prev_file_cmp(const void *a, const void *b) {
+    const tixfs_prev_file *fa = *(const tixfs_prev_file **) a;
+    const tixfs_prev_file *fb = *(const tixfs_prev_file **) b;
+
+    return strcmp(fa->path, fb->path);
+}
+
+static int tixfs_read_inode(tixfs_page_reader read_page, void *page_ctx,
+        tix_far_ptr loc, tixfs_inode *inode, const uint8_t **data) {
+    const uint8_t *page = read_page(page_ctx, loc.page);
+    int offset = loc.addr - TIXFS_REL_ADDR;
+
+    if (!page || loc.addr < TIXFS_REL_ADDR
+            || offset + TIXFS_SIZEOF_INODE > TIXFS_PAGE_SIZE) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    page += offset;
+    inode->mode = tixfs_get_word(&page[0]);
+    inode->size = tixfs_get_word(&page[2]);
+    inode->uid = page[4];
+    inode->gid = page[5];
+    inode->nlinks = page[6];
+
+    if (offset + TIXFS_SIZEOF_INODE + inode->size > TIXFS_PAGE_SIZE) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    *data = &page[TIXFS_SIZEOF_INODE];
+    return TIXFS_OK;
+}
+
+static int tixfs_walk_file(tixfs_walker *w, uint16_t num, uint16_t parent) {
+    tixfs_entry entry;
+    int path_len = w->path_len;
+    int ret;
+
+    if (num >= w->inode_cap || !w->valid[num]) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    entry.path = w->path;
+    entry.parent = parent;
+    entry.inode_num = num;
+    entry.loc = w->locs[num];
+    if (tixfs_read_inode(w->read_page, w->page_ctx, entry.loc,
+                &entry.inode, &entry.data) < 0) {
+        return TIXFS_ERR_CORRUPT;
+    }
+
+    if ((ret = w->visit(w->ctx, &entry)) < 0) {
+        return ret;
+    }
+
+    if ((entry.inode.mode & TIX_S_IFMT) != TIX_S_IFDIR || w->entered[num]) {
+        return TIXFS_OK;
+    }
+    w->entered[num] = 1;
+
+    /* The first entry is ".." */
+    for (int i = TIXFS_SIZEOF_DIR_ENTRY; i + TIXFS_SIZEOF_DIR_ENTRY
+            <= entry.inode.size; i += TIXFS_SIZEOF_DIR_ENTRY) {
+        const uint8_t *dir_entry = &entry.data[i];
+        const char *name = (const char *) &dir_entry[2];
+        int name_len = strnlen(name, TIXFS_NAME_MAX);
+
+        if (name_len == 0 || (name_len == 1 && name[0] == '.')
+                || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+            continue;
+        }
+
+        if (w->path_len + 1 + name_len + 1 > w->path_cap) {
+            char *path = realloc(w->path, w->path_cap * 2 + name_len);
+            if (!path) {
+                return TIXFS_ERR_NOMEM;
+            }
+
+            w->path = path;
+            w->path_cap = w->path_cap * 2 + name_len;
+        }
+
+        /* The root already ends in a '/' */
+        if (w->path_len > 1) {
+            w->path[w->path_len++] = '/';
+        }
+        memcpy(&w->path[w->path_len], name, name_len);
+        w->path_len += name_len;
+        w->path[w->path_len] = 0;
+
+        ret = tixfs_walk_file(w, tixfs_get_word(dir_entry), num);
+
+        w->path_len = path_len;
+        w->path[w->path_len] = 0;
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return TIXFS_OK;
+}
+
+static int tixfs_prev_visit(void *ctx, const tixfs_entry *entry) {
+    tixfs_prev *prev = ctx;
+    tix_far_ptr end = {entry->loc.page,
+        entry->loc.addr + TIXFS_SIZEOF_INODE + entry->inode.size};
+
+    if (end.page > prev->tail.page
+            || (end.page == prev->tail.page && end.addr > prev->tail.addr)) {
+        prev->tail = end;
+    }
+
+    return tixfs_prev_add(prev, entry->path, entry->inode_num, entry->loc,
+            entry->inode.size);
+}
+
+static uint16_t tixfs_get_word(const uint8_t *src) {
+    return src[0] | (src[1] << 8);
+}
+
+static int tixfs_alloc(tixfs_image *img, int size, tix_far_ptr *loc) {
+    int remaining = TIXFS_REL_ADDR + TIXFS_PAGE_SIZE - img->tail.addr;
+
+    /* Move to the next page if the file would extend past a page boundary */
+    if (remaining < TIXFS_SIZEOF_INODE + size) {
+        img->tail.addr = TIXFS_REL_ADDR;
+        img->tail.page++;
+        if (img->tail.page > img->end_page) {
+            return TIXFS_ERR_FULL;
+        }
+    }
+
+    *loc = img->tail;
+    img->tail.addr += TIXFS_SIZEOF_INODE + size;
+    img->payload_bytes += TIXFS_SIZEOF_INODE + size;
+
+    return TIXFS_OK;
+}
+
+static long tixfs_image_size(const tixfs_image *img) {
+    return (long) (img->last_page - img->start_page + 1) * TIXFS_PAGE_SIZE;
+}
+
+/**
+ * Gets a pointer to a location in the image data.
+ */
+static uint8_t *tixfs_image_ptr(const tixfs_image *img, uint8_t *data,
+        tix_far_ptr ptr) {
+    return &data[(long) (ptr.page - img->start_page) * TIXFS_PAGE_SIZE
+        + (ptr.addr - TIXFS_REL_ADDR)];
+}
+
+/**
+ * Writes a 16-bit word in little-endian order.
+ */
+static uint8_t *tixfs_put_word(uint8_t *dest, uint16_t word) {
+    dest[0] = word & 0xFF;
+    dest[1] = word >> 8;
+    return dest + 2;
+}
+
+/**
+ * Writes an inode. Since the compiler can align structure fields, they are
+ * written manually.
+ * @return Pointer to where the data goes.
+ */
+static uint8_t *tixfs_put_inode(uint8_t *dest, const tixfs_inode *inode) {
+    dest = tixfs_put_word(dest, inode->mode);
+    dest = tixfs_put_word(dest, inode->size);
+    *dest++ = inode->uid;
+    *dest++ = inode->gid;
+    *dest++ = inode->nlinks;
+    return dest;
+}
+
+static uint8_t *tixfs_put_node(const tixfs_image *img, int index,
+        uint8_t *dest) {
+    const tixfs_builder *b = img->builder;
+    const tixfs_node *node = &b->nodes[index];
+
+    dest = tixfs_put_inode(dest, &node->inode);
+
+    if ((node->inode.mode & TIX_S_IFMT) != TIX_S_IFDIR) {
+        memcpy(dest, node->data, node->inode.size);
+        return dest + node->inode.size;
+    }
+
+    /* The ".." entry is always first */
+    dest = tixfs_put_word(dest, img->inode_nums[node->parent]);
+    memset(dest, 0, TIXFS_NAME_MAX);
+    memcpy(dest, "..", 2);
+    dest += TIXFS_NAME_MAX;
+
+    for (int child = node->first_child; child >= 0;
+            child = b->nodes[child].next_sibling) {
+        dest = tixfs_put_word(dest, img->inode_nums[child]);
+        memcpy(dest, b->nodes[child].name, TIXFS_NAME_MAX);
+        dest += TIXFS_NAME_MAX;
+    }
+
+    return dest;
+}
+
+static uint8_t *tixfs_put_inode_file(const tixfs_image *img, uint8_t *dest) {
+    /* The inode file is written like a normal file with inode number 0. The
+     * data does not include the first element (the inode file).
+     */
+    tixfs_inode if_inode;
+    if_inode.mode = TIX_S_INDFIL;
+    if_inode.size = (img->inode_count - 1) * TIXFS_SIZEOF_INODE_ENTRY;
+    if_inode.uid = 0;
+    if_inode.gid = 0;
+    if_inode.nlinks = 0;
+
+    dest = tixfs_put_inode(dest, &if_inode);
+    for (int inode = 1; inode < img->inode_count; inode++) {
+        dest = tixfs_put_word(dest, inode);
+        *dest++ = img->inodes[inode].page;
+        dest = tixfs_put_word(dest, img->inodes[inode].addr);
+    }
+
+    return dest;
+}
+
+static void tixfs_encode_into(const tixfs_image *img, uint8_t *data) {
+    const tixfs_builder *b = img->builder;
+    uint8_t *dest;
+
+    /* Unused space is left as 0xFF, like erased flash */
+    memset(data, 0xFF, tixfs_image_size(img));
+
+    /* When appending, everything in the previous image is kept, including
+     * files which are no longer used
+     */
+    if (img->base) {
+        memcpy(data, img->base->pages, (long) (img->base->last_page
+                    - img->start_page + 1) * TIXFS_PAGE_SIZE);
+    }
+
+    for (int i = 0; i < b->node_count; i++) {
+        tixfs_put_node(img, i,
+                tixfs_image_ptr(img, data, img->inodes[img->inode_nums[i]]));
+    }
+
+    tixfs_put_inode_file(img, tixfs_image_ptr(img, data, img->inodes[0]));
+
+    /* Head of the filesystem = start of first page, which is the start page
+     * of the target (not always TIXFS_START_PAGE)
+     */
+    dest = &data[0];
+    *dest++ = img->start_page;
+    tixfs_put_word(dest, TIXFS_REL_ADDR);
+
+    /* The inode file location goes at the end of the anchor block */
+    dest = &data[4 * TIXFS_PAGE_SIZE - 4];
+    *dest++ = img->inodes[0].page;
+    tixfs_put_word(dest, img->inodes[0].addr);
+}
+
+/* vim: set tw=80 ft=c: */
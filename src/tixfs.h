@@ -0,0 +1,465 @@
+/**
+ * @file tixfs.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Library for building TIXFS filesystem images in memory.
+ *
+ * Files are added to a builder, which is then laid out for a range of pages
+ * and encoded into an image. None of the functions exit the process or print
+ * anything; errors are returned as negative TIXFS_ERR_* values.
+ */
+
+#ifndef TIXFS_H_
+#define TIXFS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIXFS_START_PAGE 0x04
+#define TIXFS_END_PAGE 0x6B
+
+#define TIXFS_REL_ADDR 0x4000
+
+#define TIXFS_PAGE_SIZE 0x4000
+
+#define TIXFS_NAME_MAX 14
+
+/* Only these filetypes are supported for now */
+#define TIX_S_IFMT 0xF000
+#define TIX_S_IFREG 0xC000
+#define TIX_S_IFDIR 0xD000
+#define TIX_S_IFCHR 0xA000
+#define TIX_S_IFBLK 0x9000
+
+#define TIX_S_INDFIL 0xF000
+
+/**
+ * Because the compiler can pack structures, these may not be equal to
+ * sizeof(tixfs_inode), etc.
+ */
+#define TIXFS_SIZEOF_INODE 7
+#define TIXFS_SIZEOF_DIR_ENTRY 16
+#define TIXFS_SIZEOF_INODE_ENTRY 5
+
+#define TIXFS_FILE_SIZE_MAX (TIXFS_PAGE_SIZE - sizeof(tixfs_inode))
+
+/**
+ * Parent to pass when adding the root directory.
+ */
+#define TIXFS_NO_PARENT (-1)
+
+/* Error codes */
+#define TIXFS_OK 0
+#define TIXFS_ERR_NOMEM (-1)
+#define TIXFS_ERR_INVAL (-2)
+#define TIXFS_ERR_FULL (-3)
+#define TIXFS_ERR_TOO_BIG (-4)
+#define TIXFS_ERR_TOO_MANY (-5)
+#define TIXFS_ERR_IO (-6)
+#define TIXFS_ERR_CORRUPT (-7)
+#define TIXFS_ERR_NOENT (-8)
+
+typedef struct {
+    uint8_t page;
+    uint16_t addr;
+} tix_far_ptr;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t size;
+    uint8_t uid;
+    uint8_t gid;
+    uint8_t nlinks;
+} tixfs_inode;
+
+typedef struct {
+    uint16_t inode;
+    char name[TIXFS_NAME_MAX];
+} tixfs_dir_entry;
+
+/**
+ * Attributes of a file being added.
+ */
+typedef struct tixfs_attr {
+    /**
+     * Permission bits (07777). The file type is set by the function used to
+     * add the file.
+     */
+    uint16_t mode;
+    uint8_t uid;
+    uint8_t gid;
+} tixfs_attr;
+
+typedef struct tixfs_builder tixfs_builder;
+typedef struct tixfs_image tixfs_image;
+typedef struct tixfs_prev tixfs_prev;
+
+/**
+ * How to place files which are not kept where they were in a previous layout.
+ */
+typedef enum tixfs_layout_mode {
+    /**
+     * One after the other in post-order, followed by the inode file.
+     */
+    TIXFS_LAYOUT_SEQ,
+
+    /**
+     * Each directory together with as many of its files as fit on the same
+     * page, with inode numbers in the same order, so that looking a path up
+     * switches pages less often.
+     */
+    TIXFS_LAYOUT_CLUSTER,
+} tixfs_layout_mode;
+
+/**
+ * Where to put the filesystem.
+ * This should be initialized with tixfs_target_init() so that fields added
+ * later get their default values.
+ */
+typedef struct tixfs_target {
+    /**
+     * First page of the filesystem. The first block (4 pages) is the anchor
+     * block.
+     */
+    uint8_t start_page;
+
+    /**
+     * Last page available to the filesystem.
+     */
+    uint8_t end_page;
+
+    /**
+     * Layout of a previous image, or NULL. Files which were in it keep their
+     * inode numbers and stay where they were if they still fit, and other
+     * files go in the free space around them. Otherwise, the files are placed
+     * one after the other.
+     */
+    const tixfs_prev *prev;
+
+    /**
+     * How to lay the files out when there is no previous layout.
+     */
+    tixfs_layout_mode layout;
+
+    /**
+     * If non-zero, the files are appended to the previous layout, which has to
+     * be loaded from an image with tixfs_prev_load(), instead of laid out
+     * around it. Everything up to its tail stays as it was, files which did
+     * not change keep their locations, and the others and a new inode file
+     * go after the tail. The previous layout must not be destroyed until the
+     * image is encoded.
+     */
+    int append;
+} tixfs_target;
+
+/**
+ * Summary of a laid out image.
+ */
+typedef struct tixfs_info {
+    uint8_t start_page;
+    uint8_t end_page;
+
+    /**
+     * First page after the anchor block, where the data starts.
+     */
+    uint8_t head_page;
+
+    /**
+     * Last page that has to be written, which is the end of the block
+     * containing the tail.
+     */
+    uint8_t last_page;
+
+    /**
+     * End of the data.
+     */
+    tix_far_ptr tail;
+
+    /**
+     * Location of the inode file.
+     */
+    tix_far_ptr inode_file;
+
+    /**
+     * Number of inodes, including the inode file.
+     */
+    int inode_count;
+
+    /**
+     * Bytes of inodes and data, including the inode file.
+     */
+    long payload_bytes;
+
+    /**
+     * Bytes left empty between head_page and last_page.
+     */
+    long padding_bytes;
+} tixfs_info;
+
+/**
+ * Receives the pages of an image, in the order they should be written.
+ * @param ctx Pointer passed to tixfs_image_emit().
+ * @param page Page number.
+ * @param data Contents of the page (TIXFS_PAGE_SIZE bytes).
+ * @return 0 to continue, or a negative value to stop.
+ */
+typedef int (*tixfs_sink)(void *ctx, uint8_t page, const uint8_t *data);
+
+/**
+ * Gets a description of an error code.
+ */
+const char *tixfs_strerror(int err);
+
+/**
+ * Creates an empty builder. The first file added must be the root directory.
+ * @return The builder, or NULL if out of memory.
+ */
+tixfs_builder *tixfs_builder_create(void);
+void tixfs_builder_destroy(tixfs_builder *b);
+
+/**
+ * Adds a directory.
+ * @param b Builder.
+ * @param parent Parent directory, or TIXFS_NO_PARENT for the root.
+ * @param name Name of the directory. Only the first TIXFS_NAME_MAX characters
+ * are used.
+ * @param attr Attributes of the directory.
+ * @return Handle of the new directory, or a negative error code.
+ */
+int tixfs_add_dir(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr);
+
+/**
+ * Adds a regular file with contents from a buffer. The contents are copied.
+ * @return Handle of the new file, or a negative error code.
+ */
+int tixfs_add_file(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr, const void *data, size_t size);
+
+/**
+ * Adds a regular file with contents read from a file descriptor.
+ * @param size Number of bytes to read. If the end of the file comes first,
+ * the file is shorter.
+ * @return Handle of the new file, or a negative error code.
+ */
+int tixfs_add_file_fd(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr, int fd, size_t size);
+
+/**
+ * Adds a character or block device.
+ * @param block Non-zero for a block device.
+ * @return Handle of the new device, or a negative error code.
+ */
+int tixfs_add_device(tixfs_builder *b, int parent, const char *name,
+        const tixfs_attr *attr, int block, uint8_t major, uint8_t minor);
+
+/**
+ * Replaces a file which is not a directory with a regular file, keeping its
+ * name and its place in its directory.
+ * @return Handle of the file, or a negative error code.
+ */
+int tixfs_set_file(tixfs_builder *b, int node, const tixfs_attr *attr,
+        const void *data, size_t size);
+
+/**
+ * Finds a file by its path from the root. Names longer than TIXFS_NAME_MAX
+ * match on their first TIXFS_NAME_MAX characters.
+ * @return Handle of the file, or TIXFS_ERR_NOENT if there is none.
+ */
+int tixfs_lookup(const tixfs_builder *b, const char *path);
+
+/**
+ * Finds a file by its path from a directory, as with tixfs_lookup().
+ * @param dir Handle of the directory to start from.
+ * @return Handle of the file, TIXFS_ERR_NOENT if there is none, or
+ * TIXFS_ERR_INVAL if dir is not valid.
+ */
+int tixfs_lookup_at(const tixfs_builder *b, int dir, const char *path);
+
+/**
+ * Adds a file, and the directories leading to it, to the hot list. When there
+ * is a hot list, the inode file is placed first and the hot files after it in
+ * the order they were added, before everything else. This only affects the
+ * layout when the target has no previous layout.
+ * @return 0 on success, or a negative error code.
+ */
+int tixfs_mark_hot(tixfs_builder *b, int node);
+
+/**
+ * Gets the size of a file's contents. For directories, this is the size of
+ * its entries.
+ * @return The size, or a negative error code.
+ */
+long tixfs_node_size(const tixfs_builder *b, int node);
+
+/**
+ * Gets the mode of a file, including its type (TIX_S_IFMT).
+ * @return The mode, or a negative error code.
+ */
+long tixfs_node_mode(const tixfs_builder *b, int node);
+
+/**
+ * Sorts the entries of every directory by name, comparing all TIXFS_NAME_MAX
+ * bytes as unsigned values (shorter names are padded with 0). The ".." entry
+ * stays first. Since inode numbers and placement follow the order of the
+ * entries, this also makes the image independent of the order the files were
+ * added in. Files added afterwards go at the end of their directory.
+ * @return 0 on success, or a negative error code.
+ */
+int tixfs_builder_sort(tixfs_builder *b);
+
+/**
+ * Sets a target to the default page range.
+ */
+void tixfs_target_init(tixfs_target *target);
+
+/**
+ * Decides where each file goes. The builder must not be changed or destroyed
+ * until the image is encoded.
+ * @param b Builder.
+ * @param target Where to put the filesystem.
+ * @param img Set to the new image.
+ * @return 0 on success, or a negative error code.
+ */
+int tixfs_layout(const tixfs_builder *b, const tixfs_target *target,
+        tixfs_image **img);
+
+/**
+ * Writes the files into the image. After this, the image does not depend on
+ * the builder.
+ * @return 0 on success, or a negative error code.
+ */
+int tixfs_encode(tixfs_image *img);
+
+void tixfs_image_destroy(tixfs_image *img);
+
+/**
+ * Gets a summary of a laid out image.
+ */
+void tixfs_image_info(const tixfs_image *img, tixfs_info *info);
+
+/**
+ * Gets the contents of an encoded image, starting with the anchor block.
+ * @param size Set to the size of the image in bytes, which is
+ * (last_page - start_page + 1) * TIXFS_PAGE_SIZE.
+ * @return The image data, or NULL if the image has not been encoded.
+ */
+const uint8_t *tixfs_image_data(const tixfs_image *img, size_t *size);
+
+/**
+ * Passes the pages that have to be written to a sink: the pages from head_page
+ * to last_page, then the anchor block.
+ * @return 0 on success, or the error returned by the sink.
+ */
+int tixfs_image_emit(const tixfs_image *img, tixfs_sink sink, void *ctx);
+
+/**
+ * Builds an image into a caller-supplied buffer.
+ * @param buf Buffer for the image, as returned by tixfs_image_data().
+ * @param size Size of buf.
+ * @return Number of bytes written, or a negative error code
+ * (TIXFS_ERR_TOO_BIG if buf is too small).
+ */
+long tixfs_build(const tixfs_builder *b, const tixfs_target *target,
+        void *buf, size_t size);
+
+/**
+ * Builds an image and passes its pages to a sink, as with tixfs_image_emit().
+ * @return 0 on success, or a negative error code.
+ */
+int tixfs_build_sink(const tixfs_builder *b, const tixfs_target *target,
+        tixfs_sink sink, void *ctx);
+
+/**
+ * Gets a page of an existing image.
+ * @param ctx Pointer passed along with this function.
+ * @param page Page number.
+ * @return The page (TIXFS_PAGE_SIZE bytes), or NULL if it is erased.
+ */
+typedef const uint8_t *(*tixfs_page_reader)(void *ctx, uint8_t page);
+
+/**
+ * File found in an existing image.
+ */
+typedef struct tixfs_entry {
+    /**
+     * Path from the root ("/" for the root), or NULL for the inode file.
+     */
+    const char *path;
+
+    /**
+     * Directory containing the file, or 0 for the root and the inode file.
+     */
+    uint16_t parent;
+
+    uint16_t inode_num;
+    tix_far_ptr loc;
+    tixfs_inode inode;
+
+    /**
+     * Contents of the file (inode.size bytes).
+     */
+    const uint8_t *data;
+} tixfs_entry;
+
+/**
+ * Receives the files of an existing image.
+ * @param ctx Pointer passed to tixfs_walk().
+ * @param entry File. This is only valid during the call.
+ * @return 0 to continue, or a negative value to stop.
+ */
+typedef int (*tixfs_visitor)(void *ctx, const tixfs_entry *entry);
+
+/**
+ * Walks the files of an existing image: first the inode file, then the
+ * directory tree from the root in pre-order. A file linked from several
+ * directories is visited once for each link, but each directory is only
+ * entered once.
+ * @param read_page Function to get the pages of the image.
+ * @param page_ctx Pointer to pass to read_page.
+ * @param start_page First page of the filesystem (the anchor block).
+ * @param visit Function to pass each file to.
+ * @param ctx Pointer to pass to visit.
+ * @return 0 on success, TIXFS_ERR_CORRUPT if the image is invalid, or the
+ * error returned by visit.
+ */
+int tixfs_walk(tixfs_page_reader read_page, void *page_ctx,
+        uint8_t start_page, tixfs_visitor visit, void *ctx);
+
+/**
+ * Gets a page of an encoded image. This can be used as a tixfs_page_reader
+ * with the image as the context.
+ */
+const uint8_t *tixfs_image_page(void *img, uint8_t page);
+
+/**
+ * Creates an empty previous layout for tixfs_target.prev.
+ * @return The layout, or NULL if out of memory.
+ */
+tixfs_prev *tixfs_prev_create(void);
+void tixfs_prev_destroy(tixfs_prev *prev);
+
+/**
+ * Adds the location of a file in the previous layout.
+ * @param path Path of the file from the root, or NULL for the inode file.
+ * @param inode_num Inode number of the file.
+ * @param loc Location of the inode.
+ * @param size Size of the file's contents.
+ * @return 0 on success, or a negative error code.
+ */
+int tixfs_prev_add(tixfs_prev *prev, const char *path, uint16_t inode_num,
+        tix_far_ptr loc, uint16_t size);
+
+/**
+ * Adds the locations of all of the files in an existing image, as found by
+ * tixfs_walk(), and keeps a copy of its pages up to its tail so that it can be
+ * appended to. This can only be done once for each layout.
+ * @return 0 on success, or a negative error code.
+ */
+int tixfs_prev_load(tixfs_prev *prev, tixfs_page_reader read_page,
+        void *page_ctx, uint8_t start_page);
+
+#endif /* TIXFS_H_ */
+
+/* vim: set tw=80 ft=c: */
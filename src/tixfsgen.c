@@ -2,11 +2,15 @@
  * @file tixfsgen.c
  * @author Zach Peltzer
  * @date Created: Wed, 31 Jan 2018
- * @date Last Modified: Thu, 22 Feb 2018
+ * @date Last Modified: Sun, 18 Oct 2026
  */
 
-#include <dirent.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -18,519 +22,2156 @@
 #include <sys/sysmacros.h>
 #include <sys/stat.h>
 
+#include "analyze.h"
+#include "filter.h"
+#include "flash.h"
 #include "id_map.h"
 #include "ihex.h"
+#include "layout_map.h"
+#include "manifest.h"
+#include "scan.h"
+#include "serve.h"
+#include "stats.h"
+#include "tixfs.h"
+#include "trace.h"
+
+#define DEV_MAP_KEY(major, minor) \
+    (((uint64_t) (major) << 32) | (uint32_t) (minor))
+#define DEV_MAP_VAL(major, minor) (((major) << 8) | (minor))
 
-#define TIXFS_START_PAGE 0x04
-/* TODO Set depending on model option */
-#define TIXFS_END_PAGE 0x6B
-
-#define TIXFS_REL_ADDR 0x4000
+static id_map uid_map;
+static id_map gid_map;
+static id_map dev_min_map;
+static id_map dev_maj_map;
+/* Maps a combined major and minor device number (see DEV_MAP_KEY()) to a
+ * combined TIX major and minor number (see DEV_MAP_VAL()).
+ */
+static id_map dev_map;
 
-#define TIXFS_PAGE_SIZE 0x4000
-#define TIXFS_FILE_SIZE_MAX (TIXFS_PAGE_SIZE - sizeof(tixfs_inode))
+static filter_list filter;
 
-#define TIXFS_NAME_MAX 14
+/**
+ * Calculator model, which determines how much flash is available.
+ */
+typedef struct {
+    const char *name;
 
-/* Only these filetypes are supported for now */
-#define TIX_S_IFREG 0xC000
-#define TIX_S_IFDIR 0xD000
-#define TIX_S_IFCHR 0xA000
-#define TIX_S_IFBLK 0x9000
+    /**
+     * Last page available to the filesystem.
+     */
+    uint8_t end_page;
+} calc_model;
 
-#define TIX_S_INDFIL 0xF000
+static const calc_model models[] = {
+    {"83p", 0x17},
+    {"83pse", 0x6B},
+    {"84p", 0x29},
+    {"84pse", 0x6B},
+    {NULL, 0},
+};
 
 /**
- * Because the compiler can pack structures, these may not be equal to
- * sizeof(tixfs_inode), etc.
+ * Target as given by the -m, -p, and -e options.
  */
-#define TIXFS_SIZEOF_INODE 7
-#define TIXFS_SIZEOF_DIR_ENTRY 16
-#define TIXFS_SIZEOF_INODE_ENTRY 5
+typedef struct {
+    tixfs_target target;
+    const calc_model *model;
+
+    /**
+     * Whether -e was given, so that -m does not override it.
+     */
+    int end_set;
+
+    /**
+     * Image to only write the differences from, or NULL.
+     */
+    const char *delta_from;
+
+    /**
+     * Image or layout map to keep the files in the same places as, or NULL.
+     */
+    const char *layout_from;
+
+    /**
+     * File to write the layout map to, or NULL.
+     */
+    const char *layout_map;
+
+    /**
+     * File to write the manifest to, or NULL.
+     */
+    const char *manifest;
+
+    /**
+     * Whether any of the options were given since the last -o.
+     */
+    int changed;
+} target_spec;
 
+/**
+ * Image to build and the file to write it to, along with the statistics of
+ * building it.
+ */
 typedef struct {
-    uint8_t page;
-    uint16_t addr;
-} tix_far_ptr;
+    tixfs_target target;
+    const char *filename;
+    const char *delta_from;
+    const char *layout_from;
+    const char *layout_map;
+    const char *manifest;
+
+    /**
+     * 0 if the image was written, -1 if not.
+     */
+    int ret;
+
+    double phase_time[STATS_PHASE_COUNT];
+    long payload_bytes;
+    long padding_bytes;
+    long ihex_records;
+    long ihex_bytes;
+} output_target;
+
+/**
+ * Number of pages compared at once for --delta-from: 1 for single pages, or 4
+ * for erase blocks.
+ */
+static int delta_block_pages = 1;
+
+/**
+ * How to lay out images without --layout-from.
+ */
+static tixfs_layout_mode layout_mode = TIXFS_LAYOUT_SEQ;
+
+/**
+ * Maximum number of data bytes in each Intel hex record.
+ */
+static int record_len = 32;
+
+static ihex_addressing addressing = IH_ADDR_PAGE;
+
+/**
+ * Whether to read each image back after writing it and check that it matches.
+ */
+static int verify = 0;
+
+/**
+ * Image to add the files to with --append-to, or NULL.
+ */
+static const char *append_to = NULL;
+
+/**
+ * Layout of the image being appended to, once it is loaded.
+ */
+static tixfs_prev *append_prev = NULL;
+
+/**
+ * Bytes used by the image being compacted with --compact, or -1.
+ */
+static long compact_used = -1;
 
 typedef struct {
-    uint16_t mode;
-    uint16_t size;
-    uint8_t uid;
-    uint8_t gid;
-    uint8_t nlinks;
-} tixfs_inode;
+    int len;
+    int cap;
+    output_target *outputs;
+} output_list;
 
+/**
+ * Work shared by the threads building the targets.
+ */
 typedef struct {
-    uint16_t inode;
-    char name[TIXFS_NAME_MAX];
-} tixfs_dir_entry;
+    const tixfs_builder *builder;
+    output_list *list;
+
+    /**
+     * Index of the next target to build.
+     */
+    int next;
+} build_queue;
+
+/**
+ * Values returned by getopt_long() for options which only have a long form.
+ */
+enum {
+    OPT_EXCLUDE = 0x100,
+    OPT_INCLUDE,
+    OPT_EXCLUDE_FROM,
+    OPT_ID_MAP_FILE,
+    OPT_STATS,
+    OPT_STATS_JSON,
+    OPT_DELTA_FROM,
+    OPT_DELTA_UNIT,
+    OPT_LAYOUT_FROM,
+    OPT_LAYOUT_MAP,
+    OPT_SORT,
+    OPT_HOT_LIST,
+    OPT_LAYOUT,
+    OPT_ANALYZE,
+    OPT_RECORD_LEN,
+    OPT_ADDRESSING,
+    OPT_VERIFY,
+    OPT_APPEND_TO,
+    OPT_COMPACT,
+    OPT_MANIFEST,
+    OPT_TRACE,
+};
+
+static const struct option long_options[] = {
+    {"exclude", required_argument, NULL, OPT_EXCLUDE},
+    {"include", required_argument, NULL, OPT_INCLUDE},
+    {"exclude-from", required_argument, NULL, OPT_EXCLUDE_FROM},
+    {"id-map-file", required_argument, NULL, OPT_ID_MAP_FILE},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"stats-json", required_argument, NULL, OPT_STATS_JSON},
+    {"delta-from", required_argument, NULL, OPT_DELTA_FROM},
+    {"delta-unit", required_argument, NULL, OPT_DELTA_UNIT},
+    {"layout-from", required_argument, NULL, OPT_LAYOUT_FROM},
+    {"layout-map", required_argument, NULL, OPT_LAYOUT_MAP},
+    {"sort", no_argument, NULL, OPT_SORT},
+    {"hot-list", required_argument, NULL, OPT_HOT_LIST},
+    {"layout", required_argument, NULL, OPT_LAYOUT},
+    {"analyze", no_argument, NULL, OPT_ANALYZE},
+    {"record-len", required_argument, NULL, OPT_RECORD_LEN},
+    {"addressing", required_argument, NULL, OPT_ADDRESSING},
+    {"verify", no_argument, NULL, OPT_VERIFY},
+    {"append-to", required_argument, NULL, OPT_APPEND_TO},
+    {"compact", no_argument, NULL, OPT_COMPACT},
+    {"manifest", required_argument, NULL, OPT_MANIFEST},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
 
+/**
+ * Intel hex output of an image.
+ */
 typedef struct {
-    FILE *stream;
-    ihex_data ih_writer;
+    ihex_data ih;
 
-    uint8_t start_page, end_page;
+    /**
+     * Whether any pages have been written yet.
+     */
+    int started;
 
-    tix_far_ptr head, tail;
+    /**
+     * If non-NULL, only the pages which are set in this are written.
+     */
+    const uint8_t *write_pages;
+} hex_writer;
 
-    int inode_cur;
-    int inode_cap;
-    tix_far_ptr *inodes;
-} tixfs_data;
+/**
+ * Passes a page of the image to an Intel hex writer.
+ */
+static int write_hex_page(void *ctx, uint8_t page, const uint8_t *data);
 
-static id_map uid_map;
-static id_map gid_map;
-static id_map dev_min_map;
-static id_map dev_maj_map;
+/**
+ * Recursively adds files from the scanned tree to the filesystem, reading
+ * their contents.
+ * @param b Builder to add to.
+ * @param parent Handle of the parent directory, or TIXFS_NO_PARENT for the
+ * root.
+ * @param node File in the scanned tree.
+ * @return Handle of the new file, -1 if the file was skipped, or
+ * TIXFS_ERR_TOO_MANY if the parent directory is full.
+ */
+static int read_file(tixfs_builder *b, int parent, const scan_node *node);
 
-static int tixfs_data_init(tixfs_data *fs, uint8_t start_page, uint8_t end_page,
-        FILE *stream);
-static void tixfs_finalize(tixfs_data *fs);
+/**
+ * Finds the file that a new file replaces when appending to an image.
+ * @return Handle of the file, -1 if there is none, or -2 if it cannot be
+ * replaced (a warning is printed).
+ */
+static int find_existing(const tixfs_builder *b, int parent,
+        const scan_node *node);
 
-static void tixfs_write_inode(tixfs_data *fs,
-        uint16_t inode_num, const tixfs_inode *inode);
-static void tixfs_write_file(tixfs_data *fs, uint16_t inode_num,
-        const tixfs_inode *inode, const void *data);
+/**
+ * Files of an existing image, as they are added to a builder.
+ */
+typedef struct {
+    tixfs_builder *builder;
+    const char *filename;
 
-static uint16_t tixfs_add_file(tixfs_data *fs,
-        uint16_t pinode_num, tixfs_inode *pinode, const char *path);
+    /**
+     * Handle of each directory, indexed by its inode number in the image.
+     */
+    int *dirs;
 
-static void usage(const char *exec_name);
+    /**
+     * End of the last file in the image.
+     */
+    tix_far_ptr tail;
+} image_loader;
 
-int tixfs_data_init(tixfs_data *fs, uint8_t start_page, uint8_t end_page,
-        FILE *stream) {
-    if (!fs) {
-        return -1;
-    }
+/**
+ * Adds the files of an existing image to a builder, for appending to it or
+ * compacting it.
+ * @param filename Intel hex file or flash dump to read.
+ * @param start_page First page of the filesystem in the image.
+ * @param prev If non-NULL, the layout of the image is loaded into this.
+ * @param used Set to the number of bytes from the start of the data to the
+ * end of the last file.
+ * @return 0 on success, -1 if the image could not be read.
+ */
+static int load_image(tixfs_builder *b, const char *filename,
+        uint8_t start_page, tixfs_prev *prev, long *used);
 
-    fs->start_page = start_page;
-    fs->end_page = end_page; /* TODO Actually use this value */
-    fs->stream = stream;
+/**
+ * Adds a file found by tixfs_walk() to a builder.
+ * @param ctx The image_loader.
+ */
+static int add_image_file(void *ctx, const tixfs_entry *entry);
 
-    if (ihex_data_init(&fs->ih_writer, fs->stream,
-                32, start_page + 4, TIXFS_REL_ADDR) < 0) {
-        fclose(fs->stream);
-        return -1;
-    }
+/**
+ * Builder being filled from a list of paths with -r.
+ */
+typedef struct {
+    tixfs_builder *builder;
 
-    /* 1 block (4 pages) is reserved as the anchor block */
-    fs->head = (tix_far_ptr) {start_page + 4, TIXFS_REL_ADDR};
-    fs->tail = (tix_far_ptr) {start_page + 4, TIXFS_REL_ADDR};
+    /**
+     * Handle of the root, or -1 until the first path is added.
+     */
+    int root;
 
-    fs->inode_cur = 1;
-    fs->inode_cap = 16;
-    fs->inodes = malloc(fs->inode_cap * sizeof(fs->inodes[0]));
-    if (!fs->inodes) {
-        perror("Memory error");
-        exit(EXIT_FAILURE);
-    }
+    /**
+     * Whether the paths are absolute, or -1 until the first path is added.
+     * They all have to be the same, since they are all put under one root.
+     */
+    int absolute;
+} path_list;
 
-    return 0;
-}
+/**
+ * Adds the files in a list of paths given to -r, from the arguments, or from
+ * stdin separated by NUL characters if there are none. Each path is added as
+ * soon as it is read, so that reading the files overlaps with producing the
+ * list.
+ * @param paths Paths from the arguments.
+ * @param count Number of paths, or 0 to read them from stdin.
+ */
+static void read_path_list(tixfs_builder *b, char *const *paths, int count);
 
 /**
- * Finalizes the filesystem by writing the inode file to the end of the output
- * file and writing
+ * Adds the root directory, with the attributes of a directory on the host.
  */
-void tixfs_finalize(tixfs_data *fs) {
-    if (!fs) {
-        return;
-    }
+static void add_root(path_list *list, const char *path);
 
-    /* Write the inode file */
+/**
+ * Calls stat(), counting and tracing the call.
+ */
+static int host_stat(const char *path, struct stat *st);
 
-    tixfs_inode if_inode;
+/**
+ * Adds a file from a list of paths given to -r, along with the directories
+ * leading to it which are not in the filesystem yet. The file goes at the same
+ * path in TIX, without any leading "/" or "./". Directories are added without
+ * their contents.
+ * @param path Path of the file. This is modified while the directories leading
+ * to it are read, but is restored before returning.
+ * @return 0 on success, -1 if the file was skipped.
+ */
+static int add_path(path_list *list, char *path);
 
-    if_inode.mode = TIX_S_INDFIL;
-    if_inode.size = (fs->inode_cur - 1) * TIXFS_SIZEOF_INODE_ENTRY;
-    if_inode.uid = 0;
-    if_inode.gid = 0;
-    if_inode.nlinks = 0;
+/**
+ * Reads a single file or an empty directory into the builder.
+ * @return Handle of the new file, or -1 if it was skipped.
+ */
+static int add_host_file(path_list *list, int parent, char *name, char *path,
+        const struct stat *st);
 
-    /* Write like a normal file with inode number 0. The data does not include
-     * the first element (the inode file). */
+/**
+ * Reads a list of TIX paths, one per line in the order they are used, and
+ * adds them to the builder's hot list.
+ * @return 0 on success, -1 if the file could not be read.
+ */
+static int load_hot_list(tixfs_builder *b, const char *filename);
 
-    tixfs_write_inode(fs, 0, &if_inode);
+/**
+ * Prints the estimated cost of looking up the paths in a trace, or of every
+ * file if there is no trace, in an existing image.
+ * @param filename Image, as for --delta-from.
+ * @param trace File listing TIX paths, one per line in the order they are
+ * looked up, or NULL.
+ * @param start_page First page of the filesystem.
+ * @return 0 on success, -1 if a file could not be read or the image is invalid.
+ */
+static int analyze_image(const char *filename, const char *trace,
+        uint8_t start_page);
 
-    for (int inode = 1; inode < fs->inode_cur; inode++) {
-        ihex_write_word(&fs->ih_writer, inode);
-        ihex_write_byte(&fs->ih_writer, fs->inodes[inode].page);
-        ihex_write_word(&fs->ih_writer, fs->inodes[inode].addr);
-    }
+/**
+ * Finds a model by name.
+ * @return The model, or NULL if there is none with that name.
+ */
+static const calc_model *find_model(const char *name);
 
-    fs->tail.addr += if_inode.size;
+/**
+ * Checks a target spec and adds it to the list of outputs.
+ * @param spec Target spec. This is reset to the defaults afterwards.
+ * @param filename File to write the image to.
+ * @return 0 on success, -1 if the target is invalid.
+ */
+static int add_output(output_list *list, target_spec *spec,
+        const char *filename);
 
-    /* Fill the rest of the current page with 0xFF */
-    ihex_write_fill(&fs->ih_writer, 0xFF,
-            TIXFS_REL_ADDR + TIXFS_PAGE_SIZE - fs->tail.addr);
+/**
+ * Finds the pages of an image which differ from an old image. If any page of
+ * an erase block differs, the whole block is written, since it has to be
+ * erased anyway.
+ * @param changed Set to whether each page has to be written. The anchor block
+ * is always written.
+ * @return Number of pages after the anchor block which have to be written.
+ */
+static int find_changed_pages(const tixfs_image *image,
+        const flash_image *old, uint8_t *changed);
 
-    /* Fill the rest of the current block with 0xFF */
-    for (int p = fs->tail.page+1; p % 4 > 0; p++) {
-        ihex_set_page(&fs->ih_writer, p, TIXFS_REL_ADDR);
-        ihex_write_fill(&fs->ih_writer, 0xFF, TIXFS_PAGE_SIZE);
-    }
+/**
+ * Reads an image back from the file it was written to and checks that it has
+ * the same contents.
+ * @param write_pages Pages which were written, or NULL for all of them.
+ * @return 0 if it matches, -1 if not.
+ */
+static int verify_output(const output_target *out, const tixfs_image *image,
+        const uint8_t *write_pages);
 
-    /* Head of the filesystem = start of first page */
-    ihex_set_page(&fs->ih_writer, fs->start_page, TIXFS_REL_ADDR);
-    ihex_write_byte(&fs->ih_writer, TIXFS_START_PAGE);
-    ihex_write_word(&fs->ih_writer, TIXFS_REL_ADDR);
-    /* Fill the rest of the page with 0xFF */
-    ihex_write_fill(&fs->ih_writer, 0xFF, TIXFS_PAGE_SIZE - 3);
+/**
+ * Computes a digest of everything an output file depends on: the pages of the
+ * image and the Intel hex options.
+ */
+static uint64_t output_digest(const tixfs_image *image,
+        const tixfs_info *info);
 
-    /* Fill middle pages with 0xFF */
-    ihex_set_page(&fs->ih_writer, fs->start_page + 1, TIXFS_REL_ADDR);
-    ihex_write_fill(&fs->ih_writer, 0xFF, TIXFS_PAGE_SIZE);
-    ihex_set_page(&fs->ih_writer, fs->start_page + 2, TIXFS_REL_ADDR);
-    ihex_write_fill(&fs->ih_writer, 0xFF, TIXFS_PAGE_SIZE);
+/**
+ * Writes an image to its output file in Intel hex format.
+ * @param first_page First page which is written.
+ * @param writer Writer to use, with write_pages set.
+ * @return 0 on success, -1 on error.
+ */
+static int write_output(const output_target *out, const tixfs_image *image,
+        int first_page, hex_writer *writer);
 
-    /* Fill last page with 0xFF and the inode file location */
-    ihex_set_page(&fs->ih_writer, fs->start_page + 3, TIXFS_REL_ADDR);
-    ihex_write_fill(&fs->ih_writer, 0xFF, TIXFS_PAGE_SIZE - 4);
-    /* Inode file location was stored in the inode array */
-    ihex_write_byte(&fs->ih_writer, fs->inodes[0].page);
-    ihex_write_word(&fs->ih_writer, fs->inodes[0].addr);
+/**
+ * Lays out, encodes, and writes one image. This only reads the builder, so it
+ * can be called from several threads at once.
+ */
+static void build_output(const tixfs_builder *b, output_target *out);
 
-    /* Free data */
+/**
+ * Builds targets from a queue until it is empty.
+ * @param arg The build_queue.
+ */
+static void *build_worker(void *arg);
 
-    ihex_finalize(&fs->ih_writer);
-    fclose(fs->stream);
-    free(fs->inodes);
-}
+/**
+ * User or group mapping from an ID map file. These are only added to the maps
+ * once all of the names have been looked up, so that they can be added in the
+ * order of the file.
+ */
+typedef struct {
+    int kind;
 
-void tixfs_write_inode(tixfs_data *fs,
-        uint16_t inode_num, const tixfs_inode *inode) {
-    uint16_t remaining = TIXFS_REL_ADDR + TIXFS_PAGE_SIZE - fs->tail.addr;
+    /**
+     * User or group name, or NULL if the host ID was given as a number.
+     */
+    char *name;
 
-    /* Adjust the offset and fill with 1s ($FF) if the file would extend past a
-     * page boundary
+    /**
+     * Host ID, or -1 if the name has not been found (yet).
      */
-    if (remaining < TIXFS_SIZEOF_INODE + inode->size) {
-        /* Fill with 0xFF to the end of the page */
-        ihex_write_fill(&fs->ih_writer, 0xFF, remaining);
-
-        fs->tail.addr = TIXFS_REL_ADDR;
-        fs->tail.page++;
-        if (fs->tail.page > TIXFS_END_PAGE) {
-            fprintf(stderr, "Error: Filesystem full.");
-            return;
-        }
+    long host_id;
 
-        /* Only write a page block when the page changes */
-        ihex_set_page(&fs->ih_writer, fs->tail.page, fs->tail.addr);
-    }
+    int tix_id;
 
-    /* Write the inode. Since the compiler can align structure fields, they are
-     * written manually
+    /**
+     * Position in the file, so that later lines override earlier ones.
      */
-    ihex_write_word(&fs->ih_writer, inode->mode);
-    ihex_write_word(&fs->ih_writer, inode->size);
-    ihex_write_byte(&fs->ih_writer, inode->uid);
-    ihex_write_byte(&fs->ih_writer, inode->gid);
-    ihex_write_byte(&fs->ih_writer, inode->nlinks);
+    int line;
+} pending_name;
 
-    /* Store the addresses relocated to memory bank A */
-    fs->inodes[inode_num] = fs->tail;
+typedef struct {
+    int len;
+    int cap;
+    pending_name *names;
+} pending_name_list;
 
-    fs->tail.addr += TIXFS_SIZEOF_INODE;
-}
+/**
+ * Parses an ID number.
+ * @param str String to parse.
+ * @param end Set to the first character after the number.
+ * @param max Maximum allowed value.
+ * @return The ID, or -1 if str does not start with a number in [0, max].
+ */
+static long parse_id(const char *str, char **end, long max);
 
 /**
- * Writes data to the output file.
+ * Parses an ID mapping and adds it to the corresponding map.
+ * @param kind Option character of the mapping: 'u', 'g', 'd', 'D', or 'M'.
+ * @param arg Mapping of the form <host>:<tix>, or
+ * <host major>:<host minor>:<tix major>:<tix minor> for 'M'.
+ * @param pending If non-NULL, user and group mappings are added to this list
+ * instead of to the maps, and names are looked up later instead of
+ * individually.
+ * @return 0 on success, -1 if the mapping is invalid.
  */
-void tixfs_write_file(tixfs_data *fs,
-        uint16_t inode_num,
-        const tixfs_inode *inode,
-        const void *data) {
-    if (!fs) {
-        return;
-    }
+static int add_id_mapping(int kind, char *arg, pending_name_list *pending);
 
-    /* Moves to the next page if necessary */
-    tixfs_write_inode(fs, inode_num, inode);
+/**
+ * Adds a user or group mapping to the end of a pending list.
+ * @param name Name to look up (copied), or NULL if host_id is already known.
+ */
+static void add_pending_name(pending_name_list *pending, int kind,
+        const char *name, long host_id, int tix_id);
+
+/**
+ * Reads ID mappings from a file. Each line contains one of the mapping
+ * options, without the '-', followed by its argument (e.g. "u root:0").
+ * All user and group names are looked up in a single pass over the user and
+ * group databases.
+ * @param filename File to read.
+ * @return 0 on success, -1 if the file could not be read.
+ */
+static int load_id_map_file(const char *filename);
 
-    /* Write the data */
-    ihex_write_data(&fs->ih_writer, data, inode->size);
+static int pending_name_cmp(const void *a, const void *b);
+static int pending_line_cmp(const void *a, const void *b);
 
-    fs->tail.addr += inode->size;
-}
+static void usage(const char *exec_name);
 
 /**
- * Recursively adds files to the filesystem, writing them to the output file.
- * @param fs Filesystem data.
- * @param pinode_num Inode number of the parent directory in the TIX filesystem.
- * @param pinode Inode data of the parant directory TODO Don't pass this
- * directly.
- * @param path Path of the file in the local filesystem.
+ * Builds with the given command line options.
+ * @return Exit status.
  */
-uint16_t tixfs_add_file(tixfs_data *fs,
-        uint16_t pinode_num, tixfs_inode *pinode, const char *path) {
-    FILE *file_stream;
-    DIR *dir;
-    struct dirent *dentry;
-    struct stat file_stat;
-    int id;
+static int run(int argc, char *argv[]);
 
-    tixfs_inode t_inode;
-
-    uint16_t inode_num;
+/**
+ * Checks whether an argument is the given option, which takes a value either
+ * after an '=' or in the next argument.
+ * @param value Set to the value of the option.
+ * @return Number of arguments used, or 0 if the argument is not the option.
+ */
+static int match_first_option(int argc, char *argv[], const char *name,
+        const char **value);
 
-    int buf_idx;
-    int buf_size;
-    uint8_t *buf;
+int write_hex_page(void *ctx, uint8_t page, const uint8_t *data) {
+    hex_writer *writer = ctx;
 
-    if (!fs) {
+    if (writer->write_pages && !writer->write_pages[page]) {
         return 0;
     }
 
-    /* Reserve inode first (mainly so that the root directory will have an inode
-     * number of 1). Grow the buffer if necessary.
-     */
-    if (fs->inode_cur >= fs->inode_cap) {
-        fs->inode_cap *= 2;
-        fs->inodes = realloc(fs->inodes, fs->inode_cap * sizeof(fs->inodes[0]));
-        if (!fs->inodes) {
-            perror("Memory error");
-            exit(EXIT_FAILURE);
-        }
+    trace_instant("page", "page", page);
+
+    /* The writer is initialized with the first page */
+    if (writer->started) {
+        ihex_set_page(&writer->ih, page, TIXFS_REL_ADDR);
     }
+    writer->started = 1;
 
-    inode_num = fs->inode_cur++;
+    ihex_write_data(&writer->ih, data, TIXFS_PAGE_SIZE);
+    return ferror(writer->ih.stream) ? -1 : 0;
+}
 
-    /* pinode_num == 0 means that this should be the root inode */
-    if (pinode_num == 0) {
-        pinode_num = inode_num;
-        pinode = &t_inode;
-    }
+int read_file(tixfs_builder *b, int parent, const scan_node *node) {
+    /* Contents of the file being read. Files are copied into the builder, so
+     * this can be reused.
+     */
+    static uint8_t data[TIXFS_FILE_SIZE_MAX];
 
-    if (stat(path, &file_stat) < 0) {
-        return 0;
+    const char *path = node->path;
+    const struct stat *file_stat = &node->st;
+    tixfs_attr attr;
+    int existing = -1;
+    int index;
+    int id;
+
+    /* When appending, a file which is already in the image is replaced and a
+     * directory is merged with the one there
+     */
+    if (append_to && (existing = find_existing(b, parent, node)) == -2) {
+        return -1;
     }
 
     /* Copy the UIDs and GIDs.
      * Since the size of the values is likely larger on this system than in
      * TIX, they are truncated to single-byte.
      */
-    if ((id = id_map_search(&uid_map, file_stat.st_uid)) != -1) {
-        t_inode.uid = id;
+    if ((id = id_map_search(&uid_map, file_stat->st_uid)) != -1) {
+        attr.uid = id;
     } else {
-        t_inode.uid = file_stat.st_uid;
+        attr.uid = file_stat->st_uid;
     }
-    if ((id = id_map_search(&gid_map, file_stat.st_gid)) != -1) {
-        t_inode.gid = id;
+    if ((id = id_map_search(&gid_map, file_stat->st_gid)) != -1) {
+        attr.gid = id;
     } else {
-        t_inode.gid = file_stat.st_gid;
+        attr.gid = file_stat->st_gid;
     }
 
     /* TODO Verify that all files linking to this file are in the sub-directory,
      * because otherwise an inode could never be freed within TIX. Currently,
      * hard linked files are just copied.
      */
-    t_inode.nlinks = 1;
 
-    t_inode.mode = file_stat.st_mode & 07777; /* Permission bits */
+    attr.mode = file_stat->st_mode & 07777; /* Permission bits */
+
+    if (S_ISREG(file_stat->st_mode)) {
+        long size = file_stat->st_size;
+        int fd;
+
+        if (size > (long) TIXFS_FILE_SIZE_MAX) {
+            fprintf(stderr,
+                    "Warning: Size of file \"%s\" is larger than the maximum "
+                    "file size (%ld). The file will be truncated.\n",
+                    path, (long) TIXFS_FILE_SIZE_MAX);
+            size = TIXFS_FILE_SIZE_MAX;
+        }
+
+        /* When building for a server, files which have not changed since
+         * the last build are not read again
+         */
+        long len;
+        const uint8_t *contents = serve_find_file(path, file_stat, &len);
+        if (!contents) {
+            stats.open_calls++;
+            trace_begin("open", path);
+            fd = open(path, O_RDONLY);
+            trace_end("open", NULL, 0);
+            if (fd < 0) {
+                fprintf(stderr,
+                        "Warning: File \"%s\" cannot be opened for reading. "
+                        "Skipping.\n",
+                        path);
+                return -1;
+            }
+
+            /* If the file got shorter since it was scanned, only use what is
+             * there now
+             */
+            trace_begin("read", path);
+            len = 0;
+            while (len < size) {
+                stats.read_calls++;
+                ssize_t ret = read(fd, &data[len], size - len);
+                if (ret <= 0) {
+                    break;
+                }
+                len += ret;
+            }
+
+            close(fd);
+            trace_end("read", "size", len);
+
+            stats.bytes_read += len;
+            serve_add_file(path, file_stat, data, len);
+            contents = data;
+        }
+
+        stats.files++;
+
+        if (existing >= 0) {
+            index = tixfs_set_file(b, existing, &attr, contents, len);
+        } else {
+            index = tixfs_add_file(b, parent, node->name, &attr, contents,
+                    len);
+        }
+
+    } else if (S_ISDIR(file_stat->st_mode)) {
+        index = existing >= 0
+            ? existing : tixfs_add_dir(b, parent, node->name, &attr);
+        if (index < 0) {
+            fprintf(stderr, "Error: Could not add directory \"%s\": %s.\n",
+                    path, tixfs_strerror(index));
+            exit(EXIT_FAILURE);
+        }
+
+        stats.dirs++;
+
+        for (int i = 0; i < node->child_count; i++) {
+            if (read_file(b, index, node->children[i]) == TIXFS_ERR_TOO_MANY) {
+                fprintf(stderr,
+                        "Error: Directory \"%s\" has too many entries.\n",
+                        path);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        return index;
+
+    } else if (S_ISCHR(file_stat->st_mode) || S_ISBLK(file_stat->st_mode)) {
+        uint8_t dev_major, dev_minor;
+
+        /* Get the major and minor device IDs.
+         * TODO Find a less linux-specific way to do this
+         */
+        unsigned int host_major = major(file_stat->st_rdev);
+        unsigned int host_minor = minor(file_stat->st_rdev);
+
+        /* A mapping of the whole device number takes precedence over the
+         * separate major and minor mappings
+         */
+        if ((id = id_map_search(&dev_map,
+                        DEV_MAP_KEY(host_major, host_minor))) != -1) {
+            dev_major = id >> 8;
+            dev_minor = id & 0xFF;
+        } else {
+            dev_major = host_major;
+            dev_minor = host_minor;
+
+            if ((id = id_map_search(&dev_maj_map, host_major)) != -1) {
+                dev_major = id;
+            }
+
+            if ((id = id_map_search(&dev_min_map, host_minor)) != -1) {
+                dev_minor = id;
+            }
+        }
+
+        stats.devices++;
+
+        index = tixfs_add_device(b, parent, node->name, &attr,
+                S_ISBLK(file_stat->st_mode), dev_major, dev_minor);
+
+    } else {
+        fprintf(stderr,
+                "Warning: Type of file \"%s\" is not supported. The file will "
+                "be ignored.\n",
+                path);
+        return -1;
+    }
+
+    /* The directory reports this, since it knows its own path */
+    if (index < 0 && index != TIXFS_ERR_TOO_MANY) {
+        fprintf(stderr, "Error: Could not add file \"%s\": %s.\n",
+                path, tixfs_strerror(index));
+        exit(EXIT_FAILURE);
+    }
+
+    return index;
+}
+
+int find_existing(const tixfs_builder *b, int parent,
+        const scan_node *node) {
+    int index = parent == TIXFS_NO_PARENT
+        ? 0 : tixfs_lookup_at(b, parent, node->name);
+    int is_dir;
+
+    if (index < 0) {
+        return -1;
+    }
+
+    /* Only a directory can be merged, and only a file which is not a
+     * directory can be replaced by a regular file
+     */
+    is_dir = (tixfs_node_mode(b, index) & TIX_S_IFMT) == TIX_S_IFDIR;
+    if (S_ISDIR(node->st.st_mode) ? is_dir
+            : S_ISREG(node->st.st_mode) && !is_dir) {
+        return index;
+    }
+
+    fprintf(stderr, "Warning: \"%s\" cannot replace the file of another "
+            "type in %s. Skipping.\n", node->path, append_to);
+    return -2;
+}
+
+int load_image(tixfs_builder *b, const char *filename,
+        uint8_t start_page, tixfs_prev *prev, long *used) {
+    flash_image old;
+    image_loader loader;
+    int ret;
+
+    loader.builder = b;
+    loader.filename = filename;
+    loader.dirs = malloc(0x10000 * sizeof(loader.dirs[0]));
+    loader.tail = (tix_far_ptr) {start_page + 4, TIXFS_REL_ADDR};
+    if (!loader.dirs) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+
+    flash_init(&old);
+    ret = flash_load(&old, filename);
+    if (ret == 0) {
+        ret = tixfs_walk(flash_read_page, &old, start_page, add_image_file,
+                &loader);
+    }
+    if (ret == 0 && prev) {
+        ret = tixfs_prev_load(prev, flash_read_page, &old, start_page);
+    }
+
+    flash_destroy(&old);
+    free(loader.dirs);
+
+    if (ret == TIXFS_ERR_NOMEM) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+
+    *used = (long) (loader.tail.page - start_page - 4) * TIXFS_PAGE_SIZE
+        + (loader.tail.addr - TIXFS_REL_ADDR);
+    return ret < 0 ? -1 : 0;
+}
+
+int add_image_file(void *ctx, const tixfs_entry *entry) {
+    image_loader *loader = ctx;
+    tixfs_attr attr;
+    const char *name;
+    int type = entry->inode.mode & TIX_S_IFMT;
+    int index;
+
+    tix_far_ptr end = {entry->loc.page,
+        entry->loc.addr + TIXFS_SIZEOF_INODE + entry->inode.size};
+    if (end.page > loader->tail.page
+            || (end.page == loader->tail.page
+                && end.addr > loader->tail.addr)) {
+        loader->tail = end;
+    }
+
+    /* A new inode file is made */
+    if (!entry->path) {
+        return 0;
+    }
+
+    attr.mode = entry->inode.mode & 07777;
+    attr.uid = entry->inode.uid;
+    attr.gid = entry->inode.gid;
+
+    if (entry->parent == 0) {
+        index = tixfs_add_dir(loader->builder, TIXFS_NO_PARENT, "", &attr);
+        loader->dirs[entry->inode_num] = index;
+        return index < 0 ? index : 0;
+    }
+
+    name = strrchr(entry->path, '/') + 1;
+    switch (type) {
+    case TIX_S_IFDIR:
+        index = tixfs_add_dir(loader->builder, loader->dirs[entry->parent],
+                name, &attr);
+        loader->dirs[entry->inode_num] = index;
+        break;
+
+    case TIX_S_IFREG:
+        index = tixfs_add_file(loader->builder, loader->dirs[entry->parent],
+                name, &attr, entry->data, entry->inode.size);
+        break;
+
+    case TIX_S_IFCHR:
+    case TIX_S_IFBLK:
+        if (entry->inode.size < 2) {
+            return TIXFS_ERR_CORRUPT;
+        }
+
+        index = tixfs_add_device(loader->builder, loader->dirs[entry->parent],
+                name, &attr, type == TIX_S_IFBLK, entry->data[0],
+                entry->data[1]);
+        break;
+
+    default:
+        fprintf(stderr, "Warning: Type of file \"%s\" in %s is not "
+                "supported. The file will be dropped.\n",
+                entry->path, loader->filename);
+        return 0;
+    }
+
+    return index < 0 ? index : 0;
+}
+
+void read_path_list(tixfs_builder *b, char *const *paths, int count) {
+    /* When appending, the root is already there */
+    path_list list = {b, append_to ? 0 : -1, -1};
+
+    if (count > 0) {
+        for (int i = 0; i < count; i++) {
+            add_path(&list, paths[i]);
+        }
+    } else {
+        char *path = NULL;
+        size_t path_cap = 0;
+        ssize_t len;
+
+        while ((len = getdelim(&path, &path_cap, 0, stdin)) != -1) {
+            /* The last path may not be terminated */
+            if (len > 0 && path[0] != 0) {
+                add_path(&list, path);
+            }
+        }
+
+        free(path);
+    }
+
+    /* An empty list is an empty filesystem */
+    if (list.root < 0) {
+        add_root(&list, ".");
+    }
+}
+
+int host_stat(const char *path, struct stat *st) {
+    int ret;
+
+    stats.stat_calls++;
+    trace_begin("stat", path);
+    ret = stat(path, st);
+    trace_end("stat", NULL, 0);
+
+    return ret;
+}
+
+void add_root(path_list *list, const char *path) {
+    struct stat st;
+
+    if (host_stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: Could not read directory %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    list->root = add_host_file(list, TIXFS_NO_PARENT, "", (char *) path,
+            &st);
+}
+
+int add_path(path_list *list, char *path) {
+    char *rel_path;
+    size_t rel_len = 0;
+    char *next = path;
+    int dir;
+    int ret = -1;
+
+    /* Paths are relative to the current directory or to /, whichever the
+     * first path starts from
+     */
+    if (list->absolute < 0) {
+        list->absolute = path[0] == '/';
+    } else if (list->absolute != (path[0] == '/')) {
+        fprintf(stderr, "Error: Path \"%s\" is %s, but the first path was "
+                "%s.\n", path, list->absolute ? "relative" : "absolute",
+                list->absolute ? "absolute" : "relative");
+        exit(EXIT_FAILURE);
+    }
+
+    if (list->root < 0) {
+        add_root(list, list->absolute ? "/" : ".");
+    }
+
+    /* Path from the root for the filter, without the leading '/' */
+    rel_path = malloc(strlen(path) + 1);
+    if (!rel_path) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+
+    dir = list->root;
+    for (;;) {
+        struct stat st;
+        char *name;
+        char *end;
+        const char *rest;
+        char saved;
+        int child;
+        int is_dir;
+        int last;
+
+        while (*next == '/') {
+            next++;
+        }
+
+        /* Only "/", ".", or a directory already in the filesystem */
+        if (!*next) {
+            ret = 0;
+            break;
+        }
+
+        name = next;
+        end = name + strcspn(name, "/");
+        next = end;
+        if (end - name == 1 && name[0] == '.') {
+            continue;
+        }
+
+        if (end - name == 2 && name[0] == '.' && name[1] == '.') {
+            fprintf(stderr, "Warning: Path \"%s\" contains \"..\". "
+                    "Skipping.\n", path);
+            break;
+        }
+
+        rest = end;
+        while (*rest == '/') {
+            rest++;
+        }
+        last = !*rest;
+
+        /* Cut the path off after this name, so that it is the path of this
+         * directory on the host
+         */
+        saved = *end;
+        *end = 0;
+
+        if (rel_len > 0) {
+            rel_path[rel_len++] = '/';
+        }
+        strcpy(&rel_path[rel_len], name);
+        rel_len += end - name;
+
+        child = tixfs_lookup_at(list->builder, dir, name);
+        is_dir = child >= 0 && (tixfs_node_mode(list->builder, child)
+                & TIX_S_IFMT) == TIX_S_IFDIR;
+
+        /* When appending, a file in the image is replaced by listing it */
+        if (append_to && last && !is_dir) {
+            child = -1;
+        }
+
+        if (child >= 0) {
+            /* A directory may be listed after it was added for its entries */
+            if (last && !is_dir) {
+                fprintf(stderr, "Warning: File \"%s\" was already added. "
+                        "Skipping.\n", path);
+            } else if (!is_dir) {
+                fprintf(stderr, "Warning: \"%s\" is not a directory. "
+                        "Skipping its entries.\n", path);
+                child = -1;
+            }
+        } else {
+            if (host_stat(path, &st) < 0) {
+                fprintf(stderr, "Warning: File \"%s\" cannot be read. "
+                        "Skipping.\n", path);
+            } else if (!last && !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "Warning: \"%s\" is not a directory. "
+                        "Skipping its entries.\n", path);
+            } else if (!filter_excluded(&filter, rel_path, name,
+                        S_ISDIR(st.st_mode))) {
+                child = add_host_file(list, dir, name, path, &st);
+            }
+        }
+
+        *end = saved;
+
+        if (child < 0 || last) {
+            ret = child < 0 ? -1 : 0;
+            break;
+        }
+
+        dir = child;
+    }
+
+    free(rel_path);
+    return ret;
+}
+
+int add_host_file(path_list *list, int parent, char *name, char *path,
+        const struct stat *st) {
+    scan_node node;
+    int index;
+
+    memset(&node, 0, sizeof(node));
+    node.name = name;
+    node.path = path;
+    node.st = *st;
+
+    index = read_file(list->builder, parent, &node);
+    if (index == TIXFS_ERR_TOO_MANY) {
+        fprintf(stderr, "Error: Directory containing \"%s\" has too many "
+                "entries.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    return index < 0 ? -1 : index;
+}
+
+int load_hot_list(tixfs_builder *b, const char *filename) {
+    FILE *file;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int index;
+
+    file = fopen(filename, "r");
+    if (!file) {
+        return -1;
+    }
+
+    while ((len = getline(&line, &line_cap, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = 0;
+        }
+
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        index = tixfs_lookup(b, line);
+        if (index < 0) {
+            fprintf(stderr, "Warning: Hot file is not in the filesystem: %s\n",
+                    line);
+            continue;
+        }
+
+        if (tixfs_mark_hot(b, index) < 0) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+int analyze_image(const char *filename, const char *trace,
+        uint8_t start_page) {
+    flash_image flash;
+    analyze_model model;
+    analyze_cost cost;
+    FILE *file;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int ret = 0;
+
+    flash_init(&flash);
+    if (flash_load(&flash, filename) < 0) {
+        fprintf(stderr, "Error: Could not read image %s\n", filename);
+        flash_destroy(&flash);
+        return -1;
+    }
+
+    if (!trace) {
+        ret = analyze_lookups(flash_read_page, &flash, start_page, &cost);
+        if (ret < 0) {
+            fprintf(stderr, "Error: %s: %s.\n", filename, tixfs_strerror(ret));
+            flash_destroy(&flash);
+            return -1;
+        }
+
+        analyze_print(&cost, stdout);
+        flash_destroy(&flash);
+        return 0;
+    }
+
+    file = fopen(trace, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Could not read file %s\n", trace);
+        flash_destroy(&flash);
+        return -1;
+    }
+
+    memset(&cost, 0, sizeof(cost));
+    analyze_model_init(&model, flash_read_page, &flash, start_page);
+
+    printf("%8s %8s %8s %10s  %s\n",
+            "switches", "pages", "bytes", "cycles", "path");
+    while ((len = getline(&line, &line_cap, file)) != -1) {
+        analyze_cost one = {0};
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = 0;
+        }
+
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        ret = analyze_lookup(&model, line, &one);
+        if (ret == TIXFS_ERR_CORRUPT) {
+            fprintf(stderr, "Error: %s: %s.\n", filename, tixfs_strerror(ret));
+            ret = -1;
+            break;
+        }
+
+        printf("%8ld %8ld %8ld %10ld  %s%s\n",
+                one.page_switches, one.pages_touched, one.bytes_scanned,
+                one.cycles, line, ret < 0 ? " (not found)" : "");
+
+        cost.lookups += one.lookups;
+        cost.not_found += one.not_found;
+        cost.page_switches += one.page_switches;
+        cost.pages_touched += one.pages_touched;
+        cost.bytes_scanned += one.bytes_scanned;
+        cost.cycles += one.cycles;
+        ret = 0;
+    }
+
+    if (ret == 0) {
+        printf("\n");
+        analyze_print(&cost, stdout);
+    }
+
+    free(line);
+    fclose(file);
+    flash_destroy(&flash);
+    return ret;
+}
+
+const calc_model *find_model(const char *name) {
+    for (const calc_model *model = models; model->name; model++) {
+        if (strcmp(model->name, name) == 0) {
+            return model;
+        }
+    }
+
+    return NULL;
+}
+
+int add_output(output_list *list, target_spec *spec, const char *filename) {
+    output_target *out;
+    tixfs_target target = spec->target;
+
+    if (spec->model) {
+        if (!spec->end_set) {
+            target.end_page = spec->model->end_page;
+        } else if (target.end_page > spec->model->end_page) {
+            fprintf(stderr,
+                    "Error: Page 0x%02X is past the end of the flash of the "
+                    "%s.\n",
+                    target.end_page, spec->model->name);
+            return -1;
+        }
+    }
+
+    /* There has to be room for the anchor block and at least one page */
+    if (target.end_page < target.start_page + 4) {
+        fprintf(stderr, "Error: No room for the filesystem in pages "
+                "0x%02X-0x%02X.\n",
+                target.start_page, target.end_page);
+        return -1;
+    }
+
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 4;
+        list->outputs = realloc(list->outputs,
+                list->cap * sizeof(list->outputs[0]));
+        if (!list->outputs) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    out = &list->outputs[list->len++];
+    memset(out, 0, sizeof(*out));
+    out->target = target;
+    out->filename = filename;
+    out->delta_from = spec->delta_from;
+    out->layout_from = spec->layout_from;
+    out->layout_map = spec->layout_map;
+    out->manifest = spec->manifest;
+
+    /* Each -o starts from the defaults again */
+    tixfs_target_init(&spec->target);
+    spec->model = NULL;
+    spec->end_set = 0;
+    spec->delta_from = NULL;
+    spec->layout_from = NULL;
+    spec->layout_map = NULL;
+    spec->manifest = NULL;
+    spec->changed = 0;
+
+    return 0;
+}
+
+int find_changed_pages(const tixfs_image *image, const flash_image *old,
+        uint8_t *changed) {
+    const uint8_t *data = tixfs_image_data(image, NULL);
+    tixfs_info info;
+    int count = 0;
+
+    tixfs_image_info(image, &info);
+    memset(changed, 0, FLASH_PAGE_COUNT);
+
+    for (int page = info.head_page; page <= info.last_page; page++) {
+        const uint8_t *page_data =
+            &data[(long) (page - info.start_page) * TIXFS_PAGE_SIZE];
+
+        if (!flash_page_equal(old, page, page_data)) {
+            /* Mark the whole block (or just the page) */
+            int first = page - page % delta_block_pages;
+            for (int i = first; i < first + delta_block_pages; i++) {
+                changed[i] = 1;
+            }
+        }
+    }
+
+    for (int page = info.head_page; page <= info.last_page; page++) {
+        count += changed[page];
+    }
+
+    for (int page = info.start_page; page < info.start_page + 4; page++) {
+        changed[page] = 1;
+    }
+
+    return count;
+}
+
+void build_output(const tixfs_builder *b, output_target *out) {
+    tixfs_image *image;
+    tixfs_info info;
+    hex_writer writer;
+    double start;
+    int ret;
+
+    uint64_t digest = 0;
+    int cached;
+    int up_to_date = 0;
+    long records;
+    long bytes;
+
+    uint8_t changed[FLASH_PAGE_COUNT];
+    int changed_count = 0;
+    int first_page;
+
+    tixfs_target target = out->target;
+    tixfs_prev *prev = NULL;
+
+    out->ret = -1;
+
+    start = stats_now();
+    if (out->layout_from) {
+        prev = tixfs_prev_create();
+        if (!prev) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+
+        if (layout_map_load(prev, out->layout_from, target.start_page) < 0) {
+            fprintf(stderr, "Error: Could not read layout from %s\n",
+                    out->layout_from);
+            tixfs_prev_destroy(prev);
+            return;
+        }
+
+        target.prev = prev;
+    }
+
+    if (append_prev) {
+        target.prev = append_prev;
+        target.append = 1;
+    }
+
+    target.layout = layout_mode;
+    trace_begin("layout", out->filename);
+    ret = tixfs_layout(b, &target, &image);
+    trace_end("layout", NULL, 0);
+    tixfs_prev_destroy(prev);
+    if (ret < 0) {
+        if (ret == TIXFS_ERR_TOO_MANY) {
+            fprintf(stderr, "Error: %s: Too many files for the inode file.\n",
+                    out->filename);
+        } else {
+            fprintf(stderr, "Error: %s: %s.\n", out->filename,
+                    tixfs_strerror(ret));
+        }
+        return;
+    }
+    out->phase_time[STATS_LAYOUT] = stats_now() - start;
+
+    start = stats_now();
+    trace_begin("encode", out->filename);
+    if (tixfs_encode(image) < 0) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+    trace_end("encode", NULL, 0);
+    out->phase_time[STATS_ENCODE] = stats_now() - start;
+
+    tixfs_image_info(image, &info);
+
+    if (layout_mode == TIXFS_LAYOUT_CLUSTER) {
+        analyze_cost cost;
+
+        ret = analyze_lookups(tixfs_image_page, image, info.start_page,
+                &cost);
+        if (ret < 0) {
+            fprintf(stderr, "Error: %s: %s.\n", out->filename,
+                    tixfs_strerror(ret));
+            tixfs_image_destroy(image);
+            return;
+        }
+
+        fprintf(stderr, "%s: %.2f pages touched per path lookup\n",
+                out->filename, analyze_pages_per_lookup(&cost));
+    }
+
+    if (out->layout_map) {
+        FILE *map_file = fopen(out->layout_map, "w");
+        int err = !map_file;
+
+        /* Close the file either way, and do not leave a partial map behind */
+        if (map_file) {
+            err = layout_map_write(image, map_file) < 0;
+            if (fclose(map_file) != 0 || err) {
+                remove(out->layout_map);
+                err = 1;
+            }
+        }
+
+        if (err) {
+            fprintf(stderr, "Error: Could not write file %s\n",
+                    out->layout_map);
+            tixfs_image_destroy(image);
+            return;
+        }
+    }
+
+    if (out->manifest) {
+        FILE *manifest_file = fopen(out->manifest, "w");
+        int err = !manifest_file;
+
+        /* The same as for the layout map */
+        if (manifest_file) {
+            err = manifest_write(image, manifest_file) < 0;
+            if (fclose(manifest_file) != 0 || err) {
+                remove(out->manifest);
+                err = 1;
+            }
+        }
+
+        if (err) {
+            fprintf(stderr, "Error: Could not write file %s\n",
+                    out->manifest);
+            tixfs_image_destroy(image);
+            return;
+        }
+    }
+
+    start = stats_now();
+
+    writer.started = 0;
+    writer.write_pages = NULL;
+    first_page = info.head_page;
+
+    if (out->delta_from) {
+        flash_image old;
+
+        flash_init(&old);
+        if (flash_load(&old, out->delta_from) < 0) {
+            fprintf(stderr, "Error: Could not read image %s\n",
+                    out->delta_from);
+            flash_destroy(&old);
+            tixfs_image_destroy(image);
+            return;
+        }
+
+        changed_count = find_changed_pages(image, &old, changed);
+        flash_destroy(&old);
+
+        writer.write_pages = changed;
+
+        /* The anchor block is written even if nothing else changed */
+        first_page = info.start_page;
+        for (int page = info.last_page; page >= info.head_page; page--) {
+            if (changed[page]) {
+                first_page = page;
+            }
+        }
+    }
+
+    /* A server remembers the outputs it wrote, so one which would come out
+     * the same again is left alone. Delta outputs also depend on the old
+     * image, so they are always written. Without a server, there is nothing
+     * to compare the digest with.
+     */
+    cached = serve_active() && !out->delta_from;
+    if (cached) {
+        digest = output_digest(image, &info);
+        up_to_date = serve_find_output(out->filename, digest, &records,
+                &bytes);
+    }
+
+    if (!up_to_date) {
+        trace_begin("write", out->filename);
+        ret = write_output(out, image, first_page, &writer);
+        trace_end("write", "records", writer.ih.records);
+
+        if (ret < 0) {
+            tixfs_image_destroy(image);
+            return;
+        }
+
+        records = writer.ih.records;
+        bytes = writer.ih.bytes;
+
+        if (cached) {
+            serve_add_output(out->filename, digest, records, bytes);
+        }
+    }
+
+    if (verify && verify_output(out, image, writer.write_pages) < 0) {
+        tixfs_image_destroy(image);
+        return;
+    }
+    out->phase_time[STATS_WRITE] = stats_now() - start;
+
+    tixfs_image_destroy(image);
+
+    out->payload_bytes = info.payload_bytes;
+    out->padding_bytes = info.padding_bytes;
+    out->ihex_records = records;
+    out->ihex_bytes = bytes;
+    out->ret = 0;
+
+    if (compact_used >= 0) {
+        long used = (long) (info.tail.page - info.head_page) * TIXFS_PAGE_SIZE
+            + (info.tail.addr - TIXFS_REL_ADDR);
+
+        fprintf(stderr, "%s: %ld bytes reclaimed (%ld bytes used instead of "
+                "%ld)\n", out->filename, compact_used - used, used,
+                compact_used);
+    }
+
+    if (out->delta_from) {
+        int page_count = info.last_page - info.head_page + 1;
+
+        fprintf(stderr,
+                "%s: %d of %d pages changed, %ld bytes saved\n",
+                out->filename, changed_count, page_count,
+                (long) (page_count - changed_count) * TIXFS_PAGE_SIZE);
+    }
+}
+
+uint64_t output_digest(const tixfs_image *image,
+        const tixfs_info *info) {
+    const uint8_t *data = tixfs_image_data(image, NULL);
+    uint64_t digest = SERVE_DIGEST_INIT;
+    int options[3] = {info->start_page, record_len, addressing};
+
+    /* The anchor block through the last page */
+    digest = serve_digest(digest, data,
+            (long) (info->last_page - info->start_page + 1) * TIXFS_PAGE_SIZE);
+    return serve_digest(digest, options, sizeof(options));
+}
+
+int write_output(const output_target *out, const tixfs_image *image,
+        int first_page, hex_writer *writer) {
+    FILE *out_file;
+    int ret;
+
+    out_file = fopen(out->filename, "w");
+    if (!out_file) {
+        fprintf(stderr, "Error: Could not open file %s\n", out->filename);
+        return -1;
+    }
+
+    if (ihex_data_init(&writer->ih, out_file, record_len, addressing,
+                first_page, TIXFS_REL_ADDR) < 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", out->filename);
+        fclose(out_file);
+        return -1;
+    }
+
+    ret = tixfs_image_emit(image, write_hex_page, writer);
+    ihex_finalize(&writer->ih);
+    if (ret < 0 || ferror(out_file)) {
+        fclose(out_file);
+        ret = -1;
+    } else {
+        ret = fclose(out_file);
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not write file %s\n", out->filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+int verify_output(const output_target *out, const tixfs_image *image,
+        const uint8_t *write_pages) {
+    const uint8_t *data = tixfs_image_data(image, NULL);
+    flash_image flash;
+    tixfs_info info;
+    int ret = 0;
+
+    tixfs_image_info(image, &info);
+
+    flash_init(&flash);
+    if (flash_load(&flash, out->filename) < 0) {
+        fprintf(stderr, "Error: %s: Could not read the output back.\n",
+                out->filename);
+        flash_destroy(&flash);
+        return -1;
+    }
+
+    for (int page = 0; page < FLASH_PAGE_COUNT; page++) {
+        int written = page >= info.start_page && page <= info.last_page
+            && (!write_pages || write_pages[page]);
+
+        /* Pages which were not written must not be there at all */
+        if (written ? !flash_page_equal(&flash, page,
+                    &data[(long) (page - info.start_page) * TIXFS_PAGE_SIZE])
+                : flash_page(&flash, page) != NULL) {
+            fprintf(stderr, "Error: %s: Page 0x%02X is different when read "
+                    "back.\n", out->filename, page);
+            ret = -1;
+            break;
+        }
+    }
+
+    flash_destroy(&flash);
+    return ret;
+}
+
+void *build_worker(void *arg) {
+    build_queue *queue = arg;
+    int index;
+
+    while ((index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED))
+            < queue->list->len) {
+        build_output(queue->builder, &queue->list->outputs[index]);
+    }
+
+    return NULL;
+}
+
+long parse_id(const char *str, char **end, long max) {
+    long id;
+
+    errno = 0;
+    id = strtol(str, end, 0);
+    if (*end == str || errno != 0 || id < 0 || id > max) {
+        return -1;
+    }
+
+    return id;
+}
+
+int add_id_mapping(int kind, char *arg, pending_name_list *pending) {
+    char *end_ptr;
+    long host_id, host_minor;
+    long tix_id, tix_minor;
+    struct passwd *user;
+    struct group *group;
+    id_map *map;
+
+    if (kind == 'M') {
+        if ((host_id = parse_id(arg, &end_ptr, 0xFFFFFFFF)) < 0
+                || *end_ptr != ':'
+                || (host_minor = parse_id(end_ptr + 1, &end_ptr,
+                        0xFFFFFFFF)) < 0
+                || *end_ptr != ':'
+                || (tix_id = parse_id(end_ptr + 1, &end_ptr, 0xFF)) < 0
+                || *end_ptr != ':'
+                || (tix_minor = parse_id(end_ptr + 1, &end_ptr, 0xFF)) < 0
+                || *end_ptr != 0) {
+            fprintf(stderr, "Warning: Invalid mapping: %s\n", arg);
+            return -1;
+        }
+
+        if (id_map_add(&dev_map, DEV_MAP_KEY(host_id, host_minor),
+                    DEV_MAP_VAL(tix_id, tix_minor)) < 0) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    end_ptr = strchr(arg, ':');
+    if (!end_ptr
+            || (tix_id = parse_id(end_ptr + 1, &end_ptr, 0xFF)) < 0
+            || *end_ptr != 0) {
+        fprintf(stderr, "Warning: Invalid mapping: %s\n", arg);
+        return -1;
+    }
+
+    host_id = parse_id(arg, &end_ptr, 0xFFFFFFFF);
+    if (host_id >= 0 && *end_ptr == ':') {
+        /* Numeric IDs given on the command line are checked, but there is no
+         * point in doing that for every line of a mapping file.
+         */
+        if (pending && (kind == 'u' || kind == 'g')) {
+            add_pending_name(pending, kind, NULL, host_id, tix_id);
+            return 0;
+        } else if (!pending && kind == 'u' && !getpwuid(host_id)) {
+            fprintf(stderr, "Warning: Invalid UID: %ld\n", host_id);
+            return -1;
+        } else if (!pending && kind == 'g' && !getgrgid(host_id)) {
+            fprintf(stderr, "Warning: Invalid GID: %ld\n", host_id);
+            return -1;
+        }
+    } else if (kind == 'u' || kind == 'g') {
+        end_ptr = strchr(arg, ':');
+        *end_ptr = 0; /* Temporarily modify the argument */
+
+        if (pending) {
+            add_pending_name(pending, kind, arg, -1, tix_id);
+            *end_ptr = ':';
+            return 0;
+        }
+
+        if (kind == 'u') {
+            user = getpwnam(arg);
+            if (!user) {
+                fprintf(stderr, "Warning: Invalid user: %s\n", arg);
+                *end_ptr = ':';
+                return -1;
+            }
+            host_id = user->pw_uid;
+        } else {
+            group = getgrnam(arg);
+            if (!group) {
+                fprintf(stderr, "Warning: Invalid group: %s\n", arg);
+                *end_ptr = ':';
+                return -1;
+            }
+            host_id = group->gr_gid;
+        }
+
+        *end_ptr = ':';
+    } else {
+        fprintf(stderr, "Warning: Invalid mapping: %s\n", arg);
+        return -1;
+    }
+
+    switch (kind) {
+    case 'u':
+        map = &uid_map;
+        break;
+    case 'g':
+        map = &gid_map;
+        break;
+    case 'd':
+        /* TODO Mapping minor IDs is pretty meaningless except in the context
+         * of a major ID (see -M)
+         */
+        map = &dev_min_map;
+        break;
+    default: /* 'D' */
+        map = &dev_maj_map;
+        break;
+    }
+
+    if (id_map_add(map, host_id, tix_id) < 0) {
+        perror("Memory error");
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+void add_pending_name(pending_name_list *pending, int kind,
+        const char *name, long host_id, int tix_id) {
+    pending_name *entry;
+
+    if (pending->len == pending->cap) {
+        pending->cap = pending->cap ? pending->cap * 2 : 16;
+        pending->names = realloc(pending->names,
+                pending->cap * sizeof(pending->names[0]));
+        if (!pending->names) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    entry = &pending->names[pending->len];
+    entry->kind = kind;
+    entry->name = NULL;
+    entry->host_id = host_id;
+    entry->tix_id = tix_id;
+    entry->line = pending->len;
+    pending->len++;
+
+    if (name) {
+        entry->name = strdup(name);
+        if (!entry->name) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int load_id_map_file(const char *filename) {
+    FILE *file;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int line_num = 0;
+    pending_name_list pending = {0, 0, NULL};
+    int need_users = 0, need_groups = 0;
+
+    file = fopen(filename, "r");
+    if (!file) {
+        return -1;
+    }
 
-    if (S_ISREG(file_stat.st_mode)) {
-        t_inode.mode |= TIX_S_IFREG;
+    while ((len = getline(&line, &line_cap, file)) != -1) {
+        char *arg;
 
-        /* For regular files, write the inode and data right now */
+        line_num++;
+        while (len > 0 && isspace((unsigned char) line[len - 1])) {
+            line[--len] = 0;
+        }
 
-        if (file_stat.st_size > TIXFS_FILE_SIZE_MAX) {
-            fprintf(stderr,
-                    "Warning: Size of file \"%s\" is larger than the maximum "
-                    "file size (%ld). The file will be truncated.\n",
-                    path, TIXFS_FILE_SIZE_MAX);
+        arg = line;
+        while (isspace((unsigned char) *arg)) {
+            arg++;
         }
-        t_inode.size = file_stat.st_size;
 
-        file_stream = fopen(path, "r");
-        if (!file_stream) {
-            fprintf(stderr,
-                    "Warning: File \"%s\" cannot be opened for reading. "
-                    "Skipping.\n",
-                    path);
-            return 0;
+        if (*arg == 0 || *arg == '#') {
+            continue;
         }
 
-        /* Read the file into a buffer first */
-        buf = malloc(t_inode.size);
-        if (!buf) {
-            fclose(file_stream);
-            perror("Memory error");
-            exit(EXIT_FAILURE);
+        /* Allow lines to be written like the options */
+        if (*arg == '-') {
+            arg++;
         }
 
-        fread(buf, 1, t_inode.size, file_stream);
-        tixfs_write_file(fs, inode_num, &t_inode, buf);
+        int kind = *arg++;
+        if (!strchr("ugdDM", kind)) {
+            fprintf(stderr, "Warning: Invalid mapping on line %d of %s\n",
+                    line_num, filename);
+            continue;
+        }
 
-        fclose(file_stream);
-        free(buf);
+        while (isspace((unsigned char) *arg)) {
+            arg++;
+        }
 
-    } else if (S_ISDIR(file_stat.st_mode)) {
-        t_inode.mode |= TIX_S_IFDIR;
+        add_id_mapping(kind, arg, &pending);
+    }
 
-        /* For directories, recursively add children.
-         * The children are written to the output file first sincne we have to
-         * calculate the size of this file by looking at all files in it.
-         */
+    free(line);
+    fclose(file);
 
-        dir = opendir(path);
-        if (!dir) {
-            return 0;
-        }
+    if (pending.len == 0) {
+        return 0;
+    }
 
-        buf_idx = 0;
-        buf_size = 4 * sizeof(tixfs_dir_entry);
-        buf = malloc(buf_size);
-        if (!buf) {
-            perror("Memor error");
-            exit(EXIT_FAILURE);
+    /* Resolve all of the names by reading through each database once instead
+     * of looking up each name separately
+     */
+    qsort(pending.names, pending.len, sizeof(pending.names[0]),
+            pending_name_cmp);
+
+    for (int i = 0; i < pending.len; i++) {
+        if (!pending.names[i].name) {
+            continue;
+        } else if (pending.names[i].kind == 'u') {
+            need_users = 1;
+        } else {
+            need_groups = 1;
         }
+    }
 
-        /* Write the ".." entry. */
-        buf[buf_idx++] = pinode_num & 0xFF;
-        buf[buf_idx++] = (pinode_num >> 8) & 0xFF;
-        strncpy(&buf[buf_idx], "..", TIXFS_NAME_MAX);
-        buf_idx += TIXFS_NAME_MAX;
-        /* Add a link to the parent */
-        pinode->nlinks++;
-
-        t_inode.size = sizeof(tixfs_dir_entry);
+    if (need_users) {
+        struct passwd *user;
 
-        while ((dentry = readdir(dir))) {
-            /* The ".." entry was added above since whether or not it will show
-             * up in readdir() is implementation-dependent
-             */
-            if (strcmp(dentry->d_name, ".") == 0
-                    || strcmp(dentry->d_name, "..") == 0) {
+        setpwent();
+        while ((user = getpwent())) {
+            pending_name key = {'u', user->pw_name, -1, 0, -1};
+            pending_name *match = bsearch(&key, pending.names, pending.len,
+                    sizeof(pending.names[0]), pending_name_cmp);
+            if (!match) {
                 continue;
             }
 
-            /* TODO Use some sort of relative path instead of constructing a new
-             * path each time.
-             */
-            char *ent_path = malloc(strlen(path) + strlen(dentry->d_name) + 2);
-            if (!ent_path) {
-                perror("Memor error");
-                exit(EXIT_FAILURE);
+            /* Every line with this name has to be found */
+            while (match > pending.names && match[-1].kind == 'u'
+                    && match[-1].name
+                    && strcmp(match[-1].name, user->pw_name) == 0) {
+                match--;
             }
 
-            ent_path[0] = 0;
-            strcat(ent_path, path);
-            strcat(ent_path, "/");
-            strcat(ent_path, dentry->d_name);
-
-            uint16_t ent_inode = tixfs_add_file(fs,
-                    inode_num, &t_inode, ent_path);
-            if (!ent_inode) {
-                /* Something went wrong, so skip the file */
-                continue;
+            for (; match < &pending.names[pending.len] && match->kind == 'u'
+                    && strcmp(match->name, user->pw_name) == 0; match++) {
+                match->host_id = user->pw_uid;
             }
+        }
+        endpwent();
+    }
 
-            buf[buf_idx++] = ent_inode & 0xFF;
-            buf[buf_idx++] = (ent_inode >> 8) & 0xFF;
-            strncpy(&buf[buf_idx], dentry->d_name, TIXFS_NAME_MAX);
-            buf_idx += TIXFS_NAME_MAX;
+    if (need_groups) {
+        struct group *group;
 
-            /* TODO This and buf_idx are always going to be the same value */
-            t_inode.size += sizeof(tixfs_dir_entry);
+        setgrent();
+        while ((group = getgrent())) {
+            pending_name key = {'g', group->gr_name, -1, 0, -1};
+            pending_name *match = bsearch(&key, pending.names, pending.len,
+                    sizeof(pending.names[0]), pending_name_cmp);
+            if (!match) {
+                continue;
+            }
 
-            if (buf_idx >= buf_size) { 
-                buf_size *= 2;
-                buf = realloc(buf, buf_size);
-                if (!buf) {
-                    perror("Memor error");
-                    exit(EXIT_FAILURE);
-                }
+            while (match > pending.names && match[-1].kind == 'g'
+                    && match[-1].name
+                    && strcmp(match[-1].name, group->gr_name) == 0) {
+                match--;
             }
 
-            free(ent_path);
+            for (; match < &pending.names[pending.len] && match->kind == 'g'
+                    && strcmp(match->name, group->gr_name) == 0; match++) {
+                match->host_id = group->gr_gid;
+            }
         }
+        endgrent();
+    }
 
-        tixfs_write_file(fs, inode_num, &t_inode, buf);
+    /* Add the mappings in the order of the file, so that a later line
+     * overrides an earlier one whether it uses a name or a number
+     */
+    qsort(pending.names, pending.len, sizeof(pending.names[0]),
+            pending_line_cmp);
 
-        free(buf);
-        closedir(dir);
+    for (int i = 0; i < pending.len; i++) {
+        pending_name *entry = &pending.names[i];
 
-    } else if (S_ISCHR(file_stat.st_mode) || S_ISBLK(file_stat.st_mode)) {
-        if (S_ISCHR(file_stat.st_mode)) {
-            t_inode.mode |= TIX_S_IFCHR;
-        } else {
-            t_inode.mode |= TIX_S_IFBLK;
+        if (entry->host_id < 0) {
+            fprintf(stderr, "Warning: Invalid %s: %s\n",
+                    entry->kind == 'u' ? "user" : "group", entry->name);
+        } else if (id_map_add(entry->kind == 'u' ? &uid_map : &gid_map,
+                    entry->host_id, entry->tix_id) < 0) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
         }
 
-        /* Get the major and minor device IDs.
-         * TODO Find a less linux-specific way to do this
-         */
-        uint8_t dev_id[2];
-        dev_id[0] = major(file_stat.st_rdev);
-        dev_id[1] = minor(file_stat.st_rdev);
+        free(entry->name);
+    }
+    free(pending.names);
 
-        if ((id = id_map_search(&dev_maj_map, dev_id[0])) != -1) {
-            dev_id[0] = id;
-        }
+    return 0;
+}
 
-        if ((id = id_map_search(&dev_min_map, dev_id[1])) != -1) {
-            dev_id[1] = id;
-        }
+/**
+ * Orders pending names by kind, then name, then line, with numeric IDs (which
+ * have no name) first.
+ * The line is ignored if either one is -1, so that a key can be used to search
+ * for any line with a name.
+ */
+int pending_name_cmp(const void *a, const void *b) {
+    const pending_name *pa = a;
+    const pending_name *pb = b;
+    int cmp;
 
-        t_inode.size = 2;
+    if (pa->kind != pb->kind) {
+        return pa->kind - pb->kind;
+    }
 
-        tixfs_write_file(fs, inode_num, &t_inode, dev_id);
+    if (!pa->name || !pb->name) {
+        cmp = (pa->name != NULL) - (pb->name != NULL);
     } else {
-        fprintf(stderr,
-                "Warning: Type of file \"%s\" is not supported. The file will "
-                "be ignored.\n",
-                path);
+        cmp = strcmp(pa->name, pb->name);
     }
+    if (cmp != 0 || pa->line == -1 || pb->line == -1) {
+        return cmp;
+    }
+
+    return pa->line - pb->line;
+}
 
-    return inode_num;
+int pending_line_cmp(const void *a, const void *b) {
+    return ((const pending_name *) a)->line - ((const pending_name *) b)->line;
 }
 
 void usage(const char *exec_name) {
     printf(
 "tixfsgen v0.0 by Zach Peltzer\n"
-"usage: %1$s [OPTION]... <OUTFILE> <DIRECTORY>\n"
-"   or: %1$s [OPTION]... -r <OUTFILE> <FILE>...\n"
-"Create a TIXFS filesystem from a specified root directory or files from a\n"
-"list of files to be put at the root.\n\n"
+"usage: %1$s [OPTION]... <OUTFILE> <DIRECTORY>...\n"
+"   or: %1$s [OPTION]... -o<OUTFILE>... <DIRECTORY>...\n"
+"   or: %1$s [OPTION]... -r <OUTFILE> [<FILE>...]\n"
+"   or: %1$s [-p<PAGE>] --analyze <IMAGE> [<TRACE>]\n"
+"   or: %1$s [OPTION]... --compact <OUTFILE> <IMAGE>\n"
+"   or: %1$s --serve <SOCKET>\n"
+"   or: %1$s --client <SOCKET> [OPTION]... <OUTFILE> <DIRECTORY>...\n"
+"Create a TIXFS filesystem from a specified root directory or from a list of\n"
+"files.\n"
+"If several directories are given, they are overlaid in order: files in later\n"
+"directories replace the same files in earlier ones, and a file named\n"
+"\".wh.<name>\" removes <name> from the earlier directories.\n"
+"Several images for different models or page ranges can be built from one\n"
+"read of the files by giving -m, -p, and -e before each -o.\n\n"
 "options:\n"
-"  -r               put specified files into the root director instead of\n"
-"                     using a specified root directory\n"
-"  -m<model>        model of the calculator to output for. This determines\n"
-"                     amount of flash ROM available\n"
+"  -r               put only the given files, and the directories leading to\n"
+"                     them, at the same paths in the filesystem instead of\n"
+"                     reading whole directories. Without any files, their\n"
+"                     paths are read from stdin separated by NUL characters\n"
+"                     (e.g. from find -print0)\n"
+"  -m<model>        model of the calculator to output for: 83p, 83pse, 84p,\n"
+"                     or 84pse. This determines amount of flash ROM\n"
+"                     available\n"
 "  -p<page>         page to start the filesystem. This is 0x04 by default\n"
 "  -e<page>         last page available to the filesystem. The default and\n"
 "                     maximum value are determined by the model\n"
+"  -o<file>         write an image for the -m, -p, and -e options given\n"
+"                     since the last -o to <file>. This can be given several\n"
+"                     times, and the options go back to their defaults after\n"
+"                     each one\n"
+"  -j<jobs>         build up to <jobs> images at once (default 1)\n"
 "  -u<host>:<tix>   replace the UID <host> with <tix> in the TIXFS filesystem\n"
 "  -g<host>:<tix>   replace the GID <host> with <tix> in the TIXFS filesystem\n"
 "  -d<host>:<tix>   replace the minor device number <host> with <tix> in the\n"
 "                     TIXFS filesystem\n"
 "  -D<host>:<tix>   replace the major device number <host> with <tix> in the\n"
 "                     TIXFS filesystem\n"
+"  -M<host major>:<host minor>:<tix major>:<tix minor>\n"
+"                   replace the device number <host major>:<host minor> with\n"
+"                     <tix major>:<tix minor> in the TIXFS filesystem. This\n"
+"                     takes precedence over -d and -D\n"
+"  --id-map-file=<file>\n"
+"                   read ID mappings from <file>. Each line has one of the\n"
+"                     -u, -g, -d, -D, or -M options, without the '-', and\n"
+"                     its argument (e.g. \"u root:0\")\n"
+"  --exclude=<pattern>\n"
+"                   leave out files matching the glob pattern <pattern>.\n"
+"                     Patterns containing a '/' are matched against the path\n"
+"                     from the root, others against the file name only. A\n"
+"                     trailing '/' only matches directories\n"
+"  --include=<pattern>\n"
+"                   keep files matching <pattern> even if an earlier\n"
+"                     --exclude pattern matches them\n"
+"  --exclude-from=<file>\n"
+"                   read exclude patterns from <file>, one per line. Lines\n"
+"                     starting with '!' are include patterns\n"
+"  --stats          print the time taken by each phase, counts of files and\n"
+"                     system calls, output sizes, and memory use to stderr\n"
+"  --stats-json=<file>\n"
+"                   write the same statistics to <file> (\"-\" for stdout) as\n"
+"                     JSON\n"
+"  --trace=<file>   write when each file was stat'ed, opened, and read, each\n"
+"                     directory listed, and each image laid out, encoded, and\n"
+"                     written to <file> in the Chrome trace event format\n"
+"  --delta-from=<image>\n"
+"                   only write the pages which differ from <image>, an Intel\n"
+"                     hex file or a binary dump of the flash, along with the\n"
+"                     anchor block. Like -p and -e, this applies to the next\n"
+"                     -o\n"
+"  --delta-unit=<unit>\n"
+"                   compare single pages (\"page\", the default) or whole\n"
+"                     erase blocks of 4 pages (\"block\") for --delta-from\n"
+"  --sort           sort the entries of each directory by name, so that they\n"
+"                     can be searched with a binary search and the image does\n"
+"                     not depend on the order the host lists them in\n"
+"  --hot-list=<file>\n"
+"                   put the files listed in <file> (TIX paths, one per line,\n"
+"                     in the order they are used) and the directories\n"
+"                     leading to them first, right after the inode file\n"
+"  --layout=<mode>  place the files one after the other (\"seq\", the\n"
+"                     default), or each directory on one page together with\n"
+"                     as many of its files as fit (\"cluster\"), and print\n"
+"                     the average number of pages touched per path lookup\n"
+"  --record-len=<n> put up to <n> bytes (1-255, default 32) in each Intel hex\n"
+"                     record\n"
+"  --addressing=<mode>\n"
+"                   give each page with a page record (\"page\", the\n"
+"                     default), or use flat addresses with page n at\n"
+"                     n * 0x4000 and extended linear address records\n"
+"                     (\"linear\")\n"
+"  --verify         read each image back after writing it and check that it\n"
+"                     has the same contents\n"
+"  --analyze        instead of building an image, estimate the cost of\n"
+"                     looking up each path in <TRACE> (one per line) in the\n"
+"                     existing image <IMAGE>, or every file if there is no\n"
+"                     trace: the page switches, bytes scanned, and cycles\n"
+"  --layout-from=<file>\n"
+"                   keep files which were in a previous image, or in a\n"
+"                     layout map, at the same locations and inode numbers\n"
+"                     if they still fit. Other files go in the free space\n"
+"                     between them or after them\n"
+"  --append-to=<image>\n"
+"                   add the files to the existing image <image> instead of\n"
+"                     building a new one: changed files and a new inode file\n"
+"                     go after its tail, and everything before that stays.\n"
+"                     Files already there are replaced. Only the pages which\n"
+"                     changed are written, unless --delta-from is given\n"
+"  --compact        read the files from the existing image <IMAGE> instead of\n"
+"                     a directory, leaving out old versions of files and\n"
+"                     anything else which can no longer be reached, and\n"
+"                     print the space reclaimed\n"
+"  --layout-map=<file>\n"
+"                   write the inode number, location, size, and path of each\n"
+"                     file to <file>, for a later --layout-from\n"
+"  --manifest=<file>\n"
+"                   write a CRC-32 of each page and erase block of the\n"
+"                     image, which pages are erased, and the layout map to\n"
+"                     <file>, for checking the flash without reading it all\n"
+"                     back. Like -p and -e, this applies to the next -o\n"
+"  --serve <socket> wait for builds from --client on the Unix socket\n"
+"                     <socket>, keeping the contents of the files read and\n"
+"                     the outputs written so that rebuilding after a change\n"
+"                     only reads and writes what changed. This has to be\n"
+"                     the first option\n"
+"  --client <socket>\n"
+"                   build with the rest of the options in the server\n"
+"                     listening on <socket>. This has to be the first option\n"
             ,exec_name);
 }
 
+int match_first_option(int argc, char *argv[], const char *name,
+        const char **value) {
+    size_t len = strlen(name);
+
+    if (argc < 2 || strncmp(argv[1], name, len) != 0) {
+        return 0;
+    }
+
+    if (argv[1][len] == '=') {
+        *value = &argv[1][len + 1];
+        return 1;
+    } else if (argv[1][len] == 0 && argc > 2) {
+        *value = argv[2];
+        return 2;
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    tixfs_data fs;
-    const char *in_filename, *out_filename;
-    FILE *out_file;
+    const char *socket_path;
+    int used;
+
+    /* Serving and forwarding to a server wrap the whole command line, so
+     * they are handled before anything else
+     */
+    if ((used = match_first_option(argc, argv, "--serve", &socket_path))) {
+        if (argc > used + 1) {
+            fprintf(stderr, "Error: --serve does not take other options.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        serve_run(socket_path, run);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((used = match_first_option(argc, argv, "--client", &socket_path))) {
+        int ret;
+
+        /* The program name stays first */
+        argv[used] = argv[0];
+        ret = serve_client(socket_path, argc - used, &argv[used]);
+        exit(ret < 0 ? EXIT_FAILURE : ret);
+    }
+
+    return run(argc, argv);
+}
+
+int run(int argc, char *argv[]) {
+    scan_node *root = NULL;
+    tixfs_builder *builder;
+    target_spec spec;
+    output_list outputs = {0, 0, NULL};
     int opt;
     int create_root = 0;
-    int start_page = TIXFS_START_PAGE, end_page = TIXFS_END_PAGE;
+    int jobs = 1;
+    int failed = 0;
+    int sort = 0;
+    const char *hot_list = NULL;
+    int analyze = 0;
+    int compact = 0;
 
     char *end_ptr; /** Used in strtol() */
     int tmp;
-    struct passwd *user;
-    struct group *group;
-    int host_id, tix_id;
+
+    int print_stats = 0;
+    const char *stats_filename = NULL;
 
     id_map_init(&uid_map);
     id_map_init(&gid_map);
     id_map_init(&dev_min_map);
     id_map_init(&dev_maj_map);
-
-    while ((opt = getopt(argc, argv, ":m:p:e:u:g:d:D:rh")) != -1) {
+    id_map_init(&dev_map);
+    filter_init(&filter);
+
+    tixfs_target_init(&spec.target);
+    spec.model = NULL;
+    spec.end_set = 0;
+    spec.delta_from = NULL;
+    spec.layout_from = NULL;
+    spec.layout_map = NULL;
+    spec.manifest = NULL;
+    spec.changed = 0;
+
+    while ((opt = getopt_long(argc, argv, ":m:p:e:o:j:u:g:d:D:M:rh",
+                    long_options, NULL)) != -1) {
         switch (opt) {
         case 'p':
             tmp = strtol(optarg, &end_ptr, 0);
@@ -541,7 +2182,8 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
 
-            start_page = tmp;
+            spec.target.start_page = tmp;
+            spec.changed = 1;
             break;
 
         case 'e':
@@ -553,119 +2195,175 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
 
-            end_page = tmp;
+            spec.target.end_page = tmp;
+            spec.end_set = 1;
+            spec.changed = 1;
             break;
 
-        case 'u':
-            host_id = strtol(optarg, &end_ptr, 0);
-            if (end_ptr == optarg || *end_ptr != ':') {
-                end_ptr = strchr(optarg, ':');
-                *end_ptr = 0; /* Temporarily modify the argument */
-                user = getpwnam(optarg);
-                if (!user) {
-                    fprintf(stderr, "Warning: Invalid user: %s\n", optarg);
-                    break;
-                }
-                *end_ptr = ':';
+        case 'm':
+            spec.model = find_model(optarg);
+            if (!spec.model) {
+                fprintf(stderr, "Error: Unknown model: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
 
-                host_id = user->pw_uid;
-            } else {
-                user = getpwuid(host_id);
-                if (!user) {
-                    fprintf(stderr, "Warning: Invalid UID: %d\n", host_id);
-                    break;
-                }
+            spec.changed = 1;
+            break;
+
+        case 'o':
+            if (add_output(&outputs, &spec, optarg) < 0) {
+                return EXIT_FAILURE;
             }
-            optarg = end_ptr + 1; /* Move past semicolon */
+            break;
 
-            tix_id = strtol(optarg, &end_ptr, 0);
-            if (end_ptr == optarg || *end_ptr != 0
-                    || tix_id < 0 || tix_id > 0xFF) {
-                fprintf(stderr, "Warning: Invalid mapping: %s\n", optarg);
-                break;
+        case 'j':
+            tmp = strtol(optarg, &end_ptr, 0);
+            if (end_ptr == optarg || *end_ptr != 0 || tmp < 1) {
+                fprintf(stderr,
+                        "Error: Number of jobs must be a positive integer\n");
+                return EXIT_FAILURE;
             }
 
-            id_map_add(&uid_map, host_id, tix_id);
+            jobs = tmp;
             break;
 
+        case 'u':
         case 'g':
-            host_id = strtol(optarg, &end_ptr, 0);
-            if (end_ptr == optarg || *end_ptr != ':') {
-                end_ptr = strchr(optarg, ':');
-                *end_ptr = 0; /* Temporarily modify the argument */
-                group = getgrnam(optarg);
-                if (!group) {
-                    fprintf(stderr, "Warning: Invalid group: %s\n", optarg);
-                    break;
-                }
-                *end_ptr = ':';
+        case 'd':
+        case 'D':
+        case 'M':
+            add_id_mapping(opt, optarg, NULL);
+            break;
 
-                host_id = group->gr_gid;
-            } else {
-                group = getgrgid(host_id);
-                if (!group) {
-                    fprintf(stderr, "Warning: Invalid GID: %d\n", host_id);
-                    break;
-                }
+        case OPT_ID_MAP_FILE:
+            if (load_id_map_file(optarg) < 0) {
+                fprintf(stderr, "Error: Could not read file %s\n", optarg);
+                return EXIT_FAILURE;
             }
+            break;
 
-            optarg = end_ptr + 1; /* Move past semicolon */
+        case OPT_EXCLUDE:
+        case OPT_INCLUDE:
+            if (filter_add(&filter, optarg,
+                        opt == OPT_EXCLUDE
+                        ? FILTER_EXCLUDE : FILTER_INCLUDE) < 0) {
+                fprintf(stderr, "Warning: Invalid pattern: %s\n", optarg);
+            }
+            break;
 
-            tix_id = strtol(optarg, &end_ptr, 0);
-            if (end_ptr == optarg || *end_ptr != 0
-                    || tix_id < 0 || tix_id > 0xFF) {
-                fprintf(stderr, "Warning: Invalid mapping: %s\n", optarg);
-                break;
+        case OPT_EXCLUDE_FROM:
+            if (filter_add_file(&filter, optarg) < 0) {
+                fprintf(stderr, "Error: Could not read file %s\n", optarg);
+                return EXIT_FAILURE;
             }
+            break;
 
-            id_map_add(&gid_map, host_id, tix_id);
+        case OPT_STATS:
+            print_stats = 1;
             break;
 
-        case 'd':
-            host_id = strtol(optarg, &end_ptr, 0);
-            if (end_ptr == optarg || *end_ptr != 0
-                    || tix_id < 0 || tix_id > 0xFF) {
-                fprintf(stderr, "Warning: Invalid mapping: %s\n", optarg);
-                break;
-            }
-            optarg = end_ptr + 1; /* Move past semicolon */
+        case OPT_STATS_JSON:
+            stats_filename = optarg;
+            break;
 
-            tix_id = strtol(optarg, &end_ptr, 0);
-            if (end_ptr == optarg || *end_ptr != 0
-                    || tix_id < 0 || tix_id > 0xFF) {
-                fprintf(stderr, "Warning: Invalid mapping: %s\n", optarg);
-                break;
+        case OPT_TRACE:
+            /* Start now so that the directories scanned are included */
+            trace_open(optarg);
+            break;
+
+        case OPT_DELTA_FROM:
+            spec.delta_from = optarg;
+            spec.changed = 1;
+            break;
+
+        case OPT_SORT:
+            sort = 1;
+            break;
+
+        case OPT_HOT_LIST:
+            hot_list = optarg;
+            break;
+
+        case OPT_LAYOUT_FROM:
+            spec.layout_from = optarg;
+            spec.changed = 1;
+            break;
+
+        case OPT_LAYOUT_MAP:
+            spec.layout_map = optarg;
+            spec.changed = 1;
+            break;
+
+        case OPT_MANIFEST:
+            spec.manifest = optarg;
+            spec.changed = 1;
+            break;
+
+        case OPT_DELTA_UNIT:
+            if (strcmp(optarg, "page") == 0) {
+                delta_block_pages = 1;
+            } else if (strcmp(optarg, "block") == 0) {
+                delta_block_pages = 4;
+            } else {
+                fprintf(stderr, "Error: Unknown delta unit: %s\n", optarg);
+                return EXIT_FAILURE;
             }
+            break;
 
-            /* TODO Mapping minor IDs is pretty meaningless except in the
-             * context of a major ID
-             */
-            id_map_add(&dev_min_map, host_id, tix_id);
+        case OPT_ANALYZE:
+            analyze = 1;
             break;
 
-        case 'D':
-            host_id = strtol(optarg, &end_ptr, 0);
+        case OPT_RECORD_LEN:
+            tmp = strtol(optarg, &end_ptr, 0);
             if (end_ptr == optarg || *end_ptr != 0
-                    || tix_id < 0 || tix_id > 0xFF) {
-                fprintf(stderr, "Warning: Invalid mapping: %s\n", optarg);
-                break;
+                    || tmp < 1 || tmp > IHEX_BLOCK_LEN_MAX) {
+                fprintf(stderr, "Error: Record length must be from 1 to "
+                        "%d\n", IHEX_BLOCK_LEN_MAX);
+                return EXIT_FAILURE;
             }
-            optarg = end_ptr + 1; /* Move past semicolon */
 
-            tix_id = strtol(optarg, &end_ptr, 0);
-            if (end_ptr == optarg || *end_ptr != 0
-                    || tix_id < 0 || tix_id > 0xFF) {
-                fprintf(stderr, "Warning: Invalid mapping: %s\n", optarg);
-                break;
+            record_len = tmp;
+            break;
+
+        case OPT_ADDRESSING:
+            if (strcmp(optarg, "page") == 0) {
+                addressing = IH_ADDR_PAGE;
+            } else if (strcmp(optarg, "linear") == 0) {
+                addressing = IH_ADDR_LINEAR;
+            } else {
+                fprintf(stderr, "Error: Unknown addressing: %s\n", optarg);
+                return EXIT_FAILURE;
             }
+            break;
+
+        case OPT_VERIFY:
+            verify = 1;
+            break;
+
+        case OPT_APPEND_TO:
+            append_to = optarg;
+            break;
+
+        case OPT_COMPACT:
+            compact = 1;
+            break;
 
-            id_map_add(&dev_maj_map, host_id, tix_id);
+        case OPT_LAYOUT:
+            if (strcmp(optarg, "seq") == 0) {
+                layout_mode = TIXFS_LAYOUT_SEQ;
+            } else if (strcmp(optarg, "cluster") == 0) {
+                layout_mode = TIXFS_LAYOUT_CLUSTER;
+            } else {
+                fprintf(stderr, "Error: Unknown layout: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
             break;
 
         case 'r':
-        case 'm':
-            fprintf(stderr, "Error: Unimplemented option: %c\n", opt);
-            return EXIT_FAILURE;
+            create_root = 1;
+            break;
+
         case 'h':
             usage(argv[0]);
             return EXIT_SUCCESS;
@@ -673,57 +2371,235 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Error: Argument required for option: %c\n", opt);
             return EXIT_FAILURE;
         case '?':
-            if (optopt == '-') {
-                /* "--" stops options */
-                /* TODO Parse long options ? */
-                optind++;
-                goto GETOPT_END;
+            if (optopt) {
+                fprintf(stderr, "Error: Unknown option: -%c\n", optopt);
+            } else {
+                fprintf(stderr, "Error: Unknown option: %s\n",
+                        argv[optind - 1]);
             }
-
-            fprintf(stderr, "Error: Unknown option: -%c\n", opt);
             break;
         }
     }
-GETOPT_END:
 
-    if (optind >= argc) {
-        fprintf(stderr, "Error: No output file specified.\n");
+    if (analyze) {
+        if (optind >= argc || argc - optind > 2) {
+            fprintf(stderr, "Error: --analyze takes an image and optionally "
+                    "a trace.\n");
+            return EXIT_FAILURE;
+        }
+
+        return analyze_image(argv[optind],
+                optind + 1 < argc ? argv[optind + 1] : NULL,
+                spec.target.start_page) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (outputs.len == 0) {
+        /* Without -o, the first argument is the only output */
+        if (optind >= argc) {
+            fprintf(stderr, "Error: No output file specified.\n");
+            return EXIT_FAILURE;
+        }
+
+        if (add_output(&outputs, &spec, argv[optind++]) < 0) {
+            return EXIT_FAILURE;
+        }
+    } else if (spec.changed) {
+        fprintf(stderr,
+                "Error: -m, -p, -e, --delta-from, --manifest, and the "
+                "--layout options must come before the -o they apply "
+                "to.\n");
         return EXIT_FAILURE;
     }
 
-    out_filename = argv[optind++];
-    out_file = fopen(out_filename, "w");
-    if (!out_file) {
-        fprintf(stderr, "Error: Could not open file %s\n", out_filename);
+    if (append_to) {
+        output_target *out = &outputs.outputs[0];
+
+        if (outputs.len > 1 || out->layout_from) {
+            fprintf(stderr, "Error: --append-to only builds one image, "
+                    "and cannot be used with --layout-from.\n");
+            return EXIT_FAILURE;
+        }
+
+        /* Only the pages touched by appending are written, unless the image
+         * is going somewhere else
+         */
+        if (!out->delta_from) {
+            out->delta_from = append_to;
+        }
+    }
+
+    if (compact && (argc - optind != 1 || create_root || append_to)) {
+        fprintf(stderr, "Error: --compact takes one image, and cannot be "
+                "used with -r or --append-to.\n");
         return EXIT_FAILURE;
     }
 
-    if (tixfs_data_init(&fs, start_page, end_page, out_file) < 0) {
-        return -1;
+    /* With -r, the paths can also come from stdin */
+    if (optind >= argc && !create_root) {
+        fprintf(stderr, "Error: No input directory specified.\n");
+        return EXIT_FAILURE;
     }
 
-    if (create_root) {
+    if (!create_root && !compact) {
+        /* Every remaining argument is a root to overlay onto the previous
+         * ones
+         */
+        stats_start(STATS_SCAN);
+        root = scan_tree(&argv[optind], argc - optind, &filter);
+        stats_stop(STATS_SCAN);
 
-    } else {
-        if (argc - 1 > optind) {
-            fprintf(stderr,
-                    "Warning: Multiple input files specified without -r\n");
+        if (!root) {
+            /* scan_tree() already said which root could not be read */
+            return EXIT_FAILURE;
+        }
+    }
+
+    stats_start(STATS_READ);
+    builder = tixfs_builder_create();
+    if (!builder) {
+        perror("Memory error");
+        return EXIT_FAILURE;
+    }
+
+    if (append_to) {
+        long used;
+
+        append_prev = tixfs_prev_create();
+        if (!append_prev) {
+            perror("Memory error");
+            return EXIT_FAILURE;
         }
 
-        /* 0 indicates the root inode should be used (even though its inode
-         * number is 1)
+        if (load_image(builder, append_to,
+                    outputs.outputs[0].target.start_page, append_prev,
+                    &used) < 0) {
+            fprintf(stderr, "Error: Could not read image %s\n", append_to);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (compact) {
+        /* Only the files which can still be reached are added, and they are
+         * laid out again from the start like any other files
          */
-        tixfs_add_file(&fs, 0, NULL, argv[optind]);
+        if (load_image(builder, argv[optind],
+                    outputs.outputs[0].target.start_page, NULL,
+                    &compact_used) < 0) {
+            fprintf(stderr, "Error: Could not read image %s\n",
+                    argv[optind]);
+            return EXIT_FAILURE;
+        }
+    } else if (create_root) {
+        read_path_list(builder, &argv[optind], argc - optind);
+    } else {
+        if (read_file(builder, TIXFS_NO_PARENT, root) < 0) {
+            fprintf(stderr, "Error: Could not read directory %s\n",
+                    root->path);
+            return EXIT_FAILURE;
+        }
+        scan_free(root);
+    }
+    stats_stop(STATS_READ);
+
+    if (sort) {
+        stats_start(STATS_LAYOUT);
+        if (tixfs_builder_sort(builder) < 0) {
+            perror("Memory error");
+            return EXIT_FAILURE;
+        }
+        stats_stop(STATS_LAYOUT);
+    }
+
+    if (hot_list && load_hot_list(builder, hot_list) < 0) {
+        fprintf(stderr, "Error: Could not read file %s\n", hot_list);
+        return EXIT_FAILURE;
+    }
+
+    /* The files are only read once. Each target is laid out and written
+     * separately, from several threads if asked to.
+     */
+    build_queue queue = {builder, &outputs, 0};
+
+    if (jobs > outputs.len) {
+        jobs = outputs.len;
+    }
+
+    if (jobs <= 1) {
+        build_worker(&queue);
+    } else {
+        pthread_t *threads = malloc(jobs * sizeof(threads[0]));
+        if (!threads) {
+            perror("Memory error");
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < jobs; i++) {
+            if (pthread_create(&threads[i], NULL, build_worker, &queue) != 0) {
+                fprintf(stderr, "Error: Could not create thread\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (int i = 0; i < jobs; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        free(threads);
+    }
+
+    tixfs_builder_destroy(builder);
+
+    /* The statistics of the targets are added together */
+    for (int i = 0; i < outputs.len; i++) {
+        const output_target *out = &outputs.outputs[i];
+
+        if (out->ret < 0) {
+            failed = 1;
+        }
+
+        for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+            stats.phase_time[phase] += out->phase_time[phase];
+        }
+
+        stats.payload_bytes += out->payload_bytes;
+        stats.padding_bytes += out->padding_bytes;
+        stats.ihex_records += out->ihex_records;
+        stats.ihex_bytes += out->ihex_bytes;
+    }
+
+    free(outputs.outputs);
+
+    if (print_stats || stats_filename) {
+        stats_finish();
+    }
+
+    if (print_stats) {
+        stats_print(stderr);
     }
 
-    tixfs_finalize(&fs);
+    if (stats_filename) {
+        FILE *stats_file = strcmp(stats_filename, "-") == 0
+            ? stdout : fopen(stats_filename, "w");
+        if (!stats_file) {
+            fprintf(stderr, "Error: Could not open file %s\n",
+                    stats_filename);
+            return EXIT_FAILURE;
+        }
+
+        stats_print_json(stats_file);
+        if (stats_file != stdout) {
+            fclose(stats_file);
+        }
+    }
 
     id_map_destroy(&uid_map);
     id_map_destroy(&gid_map);
     id_map_destroy(&dev_min_map);
     id_map_destroy(&dev_maj_map);
+    id_map_destroy(&dev_map);
+    filter_destroy(&filter);
 
-    return EXIT_SUCCESS;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /* vim: set tw=80 ft=c: */
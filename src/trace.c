@@ -0,0 +1,244 @@
+/**
+ * @file trace.c
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+typedef struct {
+    /**
+     * Time since tracing started, in microseconds.
+     */
+    double ts;
+
+    /**
+     * 'B' (begin), 'E' (end), or 'i' (instant).
+     */
+    char phase;
+
+    const char *name;
+    const char *key;
+    long value;
+
+    /**
+     * Offset of the path in the buffer's strings, or -1 if there is none.
+     */
+    long path;
+} trace_event;
+
+/**
+ * Events recorded by one thread.
+ */
+typedef struct trace_buffer {
+    struct trace_buffer *next;
+    int tid;
+
+    int len;
+    int cap;
+    trace_event *events;
+
+    /**
+     * Paths of the events, each terminated by a NUL.
+     */
+    size_t strings_len;
+    size_t strings_cap;
+    char *strings;
+} trace_buffer;
+
+static int trace_enabled = 0;
+static const char *trace_filename;
+static double trace_start;
+
+/**
+ * Buffers of every thread which has recorded an event.
+ */
+static trace_buffer *trace_buffers = NULL;
+static int trace_thread_count = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local trace_buffer *thread_buffer = NULL;
+
+/**
+ * Records an event in the current thread's buffer.
+ */
+static void trace_add(char phase, const char *name, const char *path,
+        const char *key, long value);
+
+/**
+ * Writes out the events of all threads. This is called at exit.
+ */
+static void trace_write(void);
+
+/**
+ * Writes a string as a JSON string.
+ */
+static void trace_put_string(const char *str, FILE *stream);
+
+void trace_open(const char *filename) {
+    trace_filename = filename;
+    trace_start = stats_now();
+
+    if (!trace_enabled) {
+        atexit(trace_write);
+    }
+    trace_enabled = 1;
+}
+
+void trace_begin(const char *name, const char *path) {
+    if (trace_enabled) {
+        trace_add('B', name, path, NULL, 0);
+    }
+}
+
+void trace_end(const char *name, const char *key, long value) {
+    if (trace_enabled) {
+        trace_add('E', name, NULL, key, value);
+    }
+}
+
+void trace_instant(const char *name, const char *key, long value) {
+    if (trace_enabled) {
+        trace_add('i', name, NULL, key, value);
+    }
+}
+
+static void trace_add(char phase, const char *name, const char *path,
+        const char *key, long value) {
+    trace_buffer *buf = thread_buffer;
+    trace_event *event;
+
+    if (!buf) {
+        buf = calloc(1, sizeof(*buf));
+        if (!buf) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Only adding the buffer to the list needs the lock */
+        pthread_mutex_lock(&trace_lock);
+        buf->tid = ++trace_thread_count;
+        buf->next = trace_buffers;
+        trace_buffers = buf;
+        pthread_mutex_unlock(&trace_lock);
+
+        thread_buffer = buf;
+    }
+
+    if (buf->len == buf->cap) {
+        buf->cap = buf->cap ? buf->cap * 2 : 1024;
+        buf->events = realloc(buf->events, buf->cap * sizeof(buf->events[0]));
+        if (!buf->events) {
+            perror("Memory error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    event = &buf->events[buf->len++];
+    event->ts = (stats_now() - trace_start) * 1e6;
+    event->phase = phase;
+    event->name = name;
+    event->key = key;
+    event->value = value;
+    event->path = -1;
+
+    if (path) {
+        size_t len = strlen(path) + 1;
+
+        if (buf->strings_len + len > buf->strings_cap) {
+            buf->strings_cap = buf->strings_cap * 2 + len + 4096;
+            buf->strings = realloc(buf->strings, buf->strings_cap);
+            if (!buf->strings) {
+                perror("Memory error");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        memcpy(&buf->strings[buf->strings_len], path, len);
+        event->path = buf->strings_len;
+        buf->strings_len += len;
+    }
+}
+
+static void trace_write(void) {
+    FILE *stream;
+    int pid = getpid();
+    int first = 1;
+
+    /* Events recorded after this would be lost */
+    trace_enabled = 0;
+
+    stream = fopen(trace_filename, "w");
+    if (!stream) {
+        fprintf(stderr, "Error: Could not write file %s\n", trace_filename);
+        return;
+    }
+
+    fprintf(stream, "{\"traceEvents\":[\n");
+
+    for (trace_buffer *buf = trace_buffers; buf; buf = buf->next) {
+        for (int i = 0; i < buf->len; i++) {
+            const trace_event *event = &buf->events[i];
+
+            fprintf(stream, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d", first ? "" : ",\n",
+                    event->name, event->phase, event->ts, pid, buf->tid);
+            first = 0;
+
+            /* Instant events only apply to their thread */
+            if (event->phase == 'i') {
+                fprintf(stream, ",\"s\":\"t\"");
+            }
+
+            if (event->path >= 0 || event->key) {
+                fprintf(stream, ",\"args\":{");
+                if (event->path >= 0) {
+                    fprintf(stream, "\"path\":");
+                    trace_put_string(&buf->strings[event->path], stream);
+                }
+                if (event->key) {
+                    fprintf(stream, "%s\"%s\":%ld",
+                            event->path >= 0 ? "," : "", event->key,
+                            event->value);
+                }
+                fputc('}', stream);
+            }
+
+            fputc('}', stream);
+        }
+    }
+
+    fprintf(stream, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    int err = ferror(stream);
+    if (fclose(stream) != 0 || err) {
+        fprintf(stderr, "Error: Could not write file %s\n", trace_filename);
+    }
+}
+
+static void trace_put_string(const char *str, FILE *stream) {
+    fputc('"', stream);
+
+    for (; *str; str++) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\') {
+            fprintf(stream, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(stream, "\\u%04x", c);
+        } else {
+            fputc(c, stream);
+        }
+    }
+
+    fputc('"', stream);
+}
+
+/* vim: set tw=80 ft=c: */
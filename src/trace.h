@@ -0,0 +1,47 @@
+/**
+ * @file trace.h
+ * @date Created: Sun, 18 Oct 2026
+ * @date Last Modified: Sun, 18 Oct 2026
+ *
+ * Timeline of the work done while building, for finding which files or
+ * directories are slow. The events are written in the Chrome trace event
+ * format, which chrome://tracing and Perfetto can open.
+ *
+ * Each thread records its events into its own buffer without locking, and all
+ * of the buffers are written out when the process exits. When tracing is not
+ * enabled, recording an event only checks a flag.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/**
+ * Starts recording events, to be written to a file at exit.
+ * @param filename File to write the events to.
+ */
+void trace_open(const char *filename);
+
+/**
+ * Records the start of a span of work.
+ * @param name Name of the work, which must be a string constant.
+ * @param path File being worked on, or NULL.
+ */
+void trace_begin(const char *name, const char *path);
+
+/**
+ * Records the end of the last span started on this thread.
+ * @param name Name of the work, as given to trace_begin().
+ * @param key Name of a value to add to the span (a string constant), or NULL.
+ * @param value Value to add.
+ */
+void trace_end(const char *name, const char *key, long value);
+
+/**
+ * Records something which happened at one point in time.
+ * @param key Name of a value to add to the event (a string constant), or NULL.
+ */
+void trace_instant(const char *name, const char *key, long value);
+
+#endif /* TRACE_H_ */
+
+/* vim: set tw=80 ft=c: */